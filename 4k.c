@@ -60,8 +60,49 @@ static ssize_t _sys(ssize_t call, ssize_t arg1, ssize_t arg2, ssize_t arg3) {
   return ret;
 }
 
+#ifdef FULL
+// Output is gathered until the end of a line and input is read in blocks, so
+// a UCI line costs a syscall or two rather than one per character
+static char output_buffer[4096];
+static i32 output_length;
+static char input_buffer[4096];
+static i32 input_start;
+static i32 input_end;
+
+static void flush_output() {
+  for (i32 written = 0; written < output_length;) {
+#ifdef ARCH64
+    const ssize_t result = _sys(1, stdout, (ssize_t)(output_buffer + written),
+                                output_length - written);
+#else
+    const ssize_t result = _sys(4, stdout, (ssize_t)(output_buffer + written),
+                                output_length - written);
+#endif
+    if (result < 1) {
+      break;
+    }
+    written += result;
+  }
+  output_length = 0;
+}
+
+static void put_char(const char ch) {
+  output_buffer[output_length++] = ch;
+  if (ch == '\n' || output_length == sizeof output_buffer) {
+    flush_output();
+  }
+}
+#endif
+
 static void exit_now() {
+#ifdef FULL
+  flush_output();
 #ifdef ARCH32
+  _sys(1, 0, 0, 0);
+#else
+  _sys(60, 0, 0, 0);
+#endif
+#elif defined(ARCH32)
   asm volatile("movl $1, %eax\n\t"
                "int $0x80");
 #else
@@ -81,7 +122,9 @@ static void exit_now() {
 static void putl(const char *const restrict string) {
   i32 length = 0;
   while (string[length]) {
-#ifdef ARCH64
+#ifdef FULL
+    put_char(string[length]);
+#elif defined(ARCH64)
     _sys(1, stdout, (ssize_t)(&string[length]), 1);
 #else
     _sys(4, stdout, (ssize_t)(&string[length]), 1);
@@ -93,17 +136,26 @@ static void putl(const char *const restrict string) {
 // Non-standard, gets but a word instead of a line
 static bool getl(char *restrict string) {
   while (true) {
+#ifdef FULL
+    if (input_start == input_end) {
 #ifdef ARCH64
-    const int result = _sys(0, stdin, (ssize_t)string, 1);
+      input_end = _sys(0, stdin, (ssize_t)input_buffer, sizeof input_buffer);
 #else
-    const int result = _sys(3, stdin, (ssize_t)string, 1);
+      input_end = _sys(3, stdin, (ssize_t)input_buffer, sizeof input_buffer);
 #endif
-
-    // Assume stdin never closes on mini build
-#ifdef FULL
-    if (result < 1) {
-      exit_now();
+      input_start = 0;
+      if (input_end < 1) {
+        exit_now();
+      }
     }
+    *string = input_buffer[input_start++];
+#else
+#ifdef ARCH64
+    _sys(0, stdin, (ssize_t)string, 1);
+#else
+    _sys(3, stdin, (ssize_t)string, 1);
+#endif
+    // Assume stdin never closes on mini build
 #endif
 
     const char ch = *string;
@@ -143,6 +195,19 @@ static bool getl(char *restrict string) {
   }
 }
 
+#ifdef FULL
+// Base 10 only, and end is never set, which is all go nodes needs
+[[nodiscard]] static u64 strtoull(const char *restrict string, char **end,
+                                  i32 base) {
+  u64 result = 0;
+  while (*string >= '0' && *string <= '9') {
+    result = result * 10 + *string - '0';
+    string++;
+  }
+  return result;
+}
+#endif
+
 #define printf(format, ...) _printf(format, (size_t[]){__VA_ARGS__})
 
 static void _printf(const char *format, const size_t *args) {
@@ -154,7 +219,9 @@ static void _printf(const char *format, const size_t *args) {
       break;
     }
     if (*format != '%') {
-#ifdef ARCH64
+#ifdef FULL
+      put_char(*format);
+#elif defined(ARCH64)
       _sys(1, stdout, (ssize_t)format, 1);
 #else
       _sys(4, stdout, (ssize_t)format, 1);
@@ -262,6 +329,25 @@ static void putl(const char *const restrict string) {
   fflush(stdout);
 }
 
+// Full build with libc: threads, files and memory mapping are available
+#if defined(FULL) && !defined(_WIN32)
+#define HOSTED
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#endif
+
+#ifdef HOSTED
+#define per_thread __thread
+#else
+#define per_thread
 #endif
 
 #pragma endregion
@@ -277,12 +363,29 @@ typedef struct [[nodiscard]] {
   u8 takes_piece;
 } Move;
 
+#ifdef FULL
+enum { nnue_hidden = 256 };
+
+typedef struct [[nodiscard]] __attribute__((aligned(64))) {
+  i16 values[2][nnue_hidden]; // Seen from white, then from black
+} Accumulator;
+#endif
+
 typedef struct [[nodiscard]] {
   u64 pieces[7];
   u64 colour[2];
   u64 ep;
   bool castling[4];
   bool flipped;
+#ifdef FULL
+  u16 halfmove; // Plies since the last capture or pawn move
+  u64 key;
+  // Material and piece-square sums for the side to move and the other side,
+  // each from its own point of view
+  i32 psq[2];
+  // NNUE accumulator while searching with the network, otherwise NULL
+  Accumulator *accumulator;
+#endif
 } Position;
 
 [[nodiscard]] static bool move_string_equal(const char *restrict lhs,
@@ -352,14 +455,7 @@ static i32 lsb(u64 bb) { return __builtin_ctzll(bb); }
 
 static u64 diag_mask[64];
 
-static void init_diag_masks() {
-  for (i32 sq = 0; sq < 64; sq++) {
-    diag_mask[sq] = ray(sq, 0, 9, ~0x101010101010101ull) |  // Northeast
-                    ray(sq, 0, -9, ~0x8080808080808080ull); // Southwest
-  }
-}
-
-[[nodiscard]] static u64 bishop(const i32 sq, const u64 blockers) {
+[[nodiscard]] static u64 bishop_rays(const i32 sq, const u64 blockers) {
   assert(sq >= 0);
   assert(sq < 64);
 
@@ -367,7 +463,7 @@ static void init_diag_masks() {
          xattack(sq, blockers, flip_bb(diag_mask[sq ^ 56]));
 }
 
-[[nodiscard]] static u64 rook(const i32 sq, const u64 blockers) {
+[[nodiscard]] static u64 rook_rays(const i32 sq, const u64 blockers) {
   assert(sq >= 0);
   assert(sq < 64);
   return xattack(sq, blockers, 1ULL << sq ^ 0x101010101010101ULL << sq % 8) |
@@ -375,6 +471,155 @@ static void init_diag_masks() {
          | ray(sq, blockers, -1, ~0x8080808080808080ull); // West
 }
 
+#ifdef FULL
+// Slider attacks are looked up by the relevant blockers, which are gathered
+// into a dense index with pext where BMI2 is available and with fancy magic
+// multiplication elsewhere
+typedef struct [[nodiscard]] {
+  u64 mask;
+#ifndef __BMI2__
+  u64 magic;
+  i32 shift;
+#endif
+  u64 *attacks;
+} SliderTable;
+
+static SliderTable bishop_tables[64];
+static SliderTable rook_tables[64];
+static u64 slider_attacks[5248 + 102400];
+
+#ifndef __BMI2__
+static const u64 bishop_magics[64] = {
+    0xA010041108003100ull, 0x6082020A002900ull, 0x6810010619200000ull,
+    0x8281A0520000408ull, 0x1104001000400ull, 0x18901008048400ull,
+    0x40A0210245280ull, 0x200210808A402ull, 0x9140048410821200ull,
+    0x800091010820041ull, 0x20504804832202C0ull, 0x100091401081000ull,
+    0x8021011140000012ull, 0x810020804450400ull, 0x208B0542109008A2ull,
+    0x80084A08040204ull, 0x40E2A80811244Cull, 0x2505022008008108ull,
+    0x430220100420040ull, 0x10A040420220040ull, 0x1105000290400000ull,
+    0x93001200822120ull, 0x4000A62048043004ull, 0x280120048A015004ull,
+    0x6090002A020814ull, 0x44042000240800D0ull, 0x1102800040A4400ull,
+    0x1004080080220040ull, 0x1001011004024ull, 0x10044000805040ull,
+    0x914041200820100ull, 0x4821012821480ull, 0x24040500C05021ull,
+    0x88611002080200ull, 0x116080A00040020ull, 0x4000020080080080ull,
+    0x2450450140840040ull, 0x880201484100ull, 0x222020404020092ull,
+    0x8081110600002E00ull, 0x2842101105000801ull, 0x1100809008001025ull,
+    0x20202221C0400ull, 0x422014022009020ull, 0x210046102100C00ull,
+    0xC004008082029102ull, 0xAA461801101200ull, 0x404080080201108ull,
+    0x20542108C205002ull, 0x410544804100100ull, 0x40910841100000ull,
+    0x400200042021100ull, 0x4204850400C0ull, 0x200100410A42102ull,
+    0x1040020801210102ull, 0x805040410420000ull, 0x2884804130100200ull,
+    0x800C262201242000ull, 0x1058000194108800ull, 0x14221054420204ull,
+    0x104000012A02200ull, 0x200881003300100ull, 0x140400202840100ull,
+    0x402020801010201ull,
+};
+static const u64 rook_magics[64] = {
+    0x1080004008801020ull, 0x840092002C03000ull, 0x1900200010400900ull,
+    0x880100008000480ull, 0x4200100420080200ull, 0x8100020100080400ull,
+    0x200040110886200ull, 0x200008040220411ull, 0x404800084400220ull,
+    0x401000402000ull, 0x86001081220440ull, 0x408800800100280ull,
+    0xA001201040820ull, 0x8848800200840080ull, 0x4001000100040200ull,
+    0x442000102105084ull, 0x9080010020804100ull, 0x40404000201009ull,
+    0x808010002009ull, 0x2200090021D00100ull, 0x8008008040080ull,
+    0x4004002010040ull, 0x11040008015042ull, 0xA0001768104ull,
+    0x800080204009ull, 0x2010004140002001ull, 0x9800200280100080ull,
+    0x1000100080080080ull, 0x442000A00049020ull, 0x2100040080020080ull,
+    0x800120400900148ull, 0x10040A00128541ull, 0x2800804000800030ull,
+    0x1010002000400041ull, 0x4000200011004100ull, 0x610008410800800ull,
+    0x400802402800800ull, 0xC100020080800400ull, 0x2000802000401ull,
+    0x182085882000401ull, 0x220204000808000ull, 0x2860100040024022ull,
+    0x1002004110040ull, 0x99101042000A0020ull, 0x4080004008080ull,
+    0x10040002008080ull, 0x2012004881020004ull, 0x8300842444820011ull,
+    0x88403882010200ull, 0x820400080210100ull, 0x110910040A00300ull,
+    0x801100280080480ull, 0x242009008200600ull, 0x1002000489500200ull,
+    0x40800200010080ull, 0x91800041000080ull, 0x209300488001ull,
+    0x4C1002414824001ull, 0x20020000B001041ull, 0x7000100004200901ull,
+    0x8002002004100802ull, 0x30010002084C0007ull, 0x888221800813004ull,
+    0x4000002840840112ull,
+};
+#endif
+
+[[nodiscard]] static size_t slider_index(const SliderTable *const table,
+                                         const u64 blockers) {
+#ifdef __BMI2__
+  return __builtin_ia32_pext_di(blockers, table->mask);
+#else
+  return (blockers & table->mask) * table->magic >> table->shift;
+#endif
+}
+
+static u64 *init_slider_table(SliderTable *const table, u64 *const attacks,
+                              const i32 sq, u64 (*const rays)(i32, u64)) {
+  // Blockers on the edge of the board never change the attacks, unless the
+  // slider itself stands on that edge
+  const u64 edges = 0xFF000000000000FFull & ~(0xFFull << (sq & 56)) |
+                    0x8181818181818181ull & ~(0x101010101010101ull << sq % 8);
+  table->mask = rays(sq, 0) & ~edges;
+  table->attacks = attacks;
+#ifndef __BMI2__
+  table->shift = 64 - count(table->mask);
+#endif
+
+  // Walk every subset of the mask
+  u64 blockers = 0;
+  do {
+    attacks[slider_index(table, blockers)] = rays(sq, blockers);
+    blockers = blockers - table->mask & table->mask;
+  } while (blockers);
+
+  return attacks + (1ull << count(table->mask));
+}
+
+static void init_slider_tables() {
+  u64 *attacks = slider_attacks;
+  for (i32 sq = 0; sq < 64; sq++) {
+#ifndef __BMI2__
+    bishop_tables[sq].magic = bishop_magics[sq];
+    rook_tables[sq].magic = rook_magics[sq];
+#endif
+    attacks = init_slider_table(&bishop_tables[sq], attacks, sq, bishop_rays);
+    attacks = init_slider_table(&rook_tables[sq], attacks, sq, rook_rays);
+  }
+  assert(attacks == slider_attacks + sizeof(slider_attacks) / sizeof(u64));
+}
+
+[[nodiscard]] static u64 bishop(const i32 sq, const u64 blockers) {
+  assert(sq >= 0);
+  assert(sq < 64);
+  const u64 attacks =
+      bishop_tables[sq].attacks[slider_index(&bishop_tables[sq], blockers)];
+  assert(attacks == bishop_rays(sq, blockers));
+  return attacks;
+}
+
+[[nodiscard]] static u64 rook(const i32 sq, const u64 blockers) {
+  assert(sq >= 0);
+  assert(sq < 64);
+  const u64 attacks =
+      rook_tables[sq].attacks[slider_index(&rook_tables[sq], blockers)];
+  assert(attacks == rook_rays(sq, blockers));
+  return attacks;
+}
+#else
+[[nodiscard]] static u64 bishop(const i32 sq, const u64 blockers) {
+  return bishop_rays(sq, blockers);
+}
+
+[[nodiscard]] static u64 rook(const i32 sq, const u64 blockers) {
+  return rook_rays(sq, blockers);
+}
+#endif
+
+static void init_diag_masks() {
+  for (i32 sq = 0; sq < 64; sq++) {
+    diag_mask[sq] = ray(sq, 0, 9, ~0x101010101010101ull) |  // Northeast
+                    ray(sq, 0, -9, ~0x8080808080808080ull); // Southwest
+  }
+#ifdef FULL
+  init_slider_tables();
+#endif
+}
+
 [[nodiscard]] static u64 knight(const i32 sq) {
   assert(sq >= 0);
   assert(sq < 64);
@@ -438,8 +683,17 @@ static void swapu32(u32 *const lhs, u32 *const rhs) {
   *rhs = temp;
 }
 
+// FULL builds copy and compare moves through their own type. Under strict
+// aliasing the punned u32 accesses may be reordered against the struct stores
+// the move picker makes, which silently changed the search at -O3.
 static void swapmoves(Move *const lhs, Move *const rhs) {
+#ifdef FULL
+  const Move temp = *lhs;
+  *lhs = *rhs;
+  *rhs = temp;
+#else
   swapu32((u32 *)lhs, (u32 *)rhs);
+#endif
 }
 
 static void swapbool(bool *const restrict lhs, bool *const restrict rhs) {
@@ -449,7 +703,12 @@ static void swapbool(bool *const restrict lhs, bool *const restrict rhs) {
 }
 
 [[nodiscard]] static bool move_equal(Move *const lhs, Move *const rhs) {
+#ifdef FULL
+  return lhs->from == rhs->from && lhs->to == rhs->to &&
+         lhs->promo == rhs->promo && lhs->takes_piece == rhs->takes_piece;
+#else
   return *(u32 *)lhs == *(u32 *)rhs;
+#endif
 }
 
 static void flip_pos(Position *const restrict pos) {
@@ -465,6 +724,9 @@ static void flip_pos(Position *const restrict pos) {
     swapbool(&pos->castling[i], &pos->castling[i + 2]);
   }
   swapu64(&pos->colour[0], &pos->colour[1]);
+#ifdef FULL
+  swapu32((u32 *)&pos->psq[0], (u32 *)&pos->psq[1]);
+#endif
 }
 
 [[nodiscard]] static u64 get_mobility(const i32 sq, const i32 piece,
@@ -505,7 +767,335 @@ static void flip_pos(Position *const restrict pos) {
          king(sq) & theirs & pos->pieces[King];
 }
 
+#ifdef FULL
+// Zobrist keys are indexed from white's point of view, so they survive the
+// board flip at the end of every move
+static u64 zobrist_pieces[2][7][64];
+static u64 zobrist_castling[4];
+static u64 zobrist_ep[8];
+static u64 zobrist_side;
+
+static void init_zobrist() {
+  u64 seed = 0x4b2c0ffee4b1d5ull;
+  u64 *const keys = (u64 *)zobrist_pieces;
+  for (i32 i = 0; i < 2 * 7 * 64 + 4 + 8 + 1; i++) {
+    // SplitMix64
+    u64 z = seed += 0x9e3779b97f4a7c15ull;
+    z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ z >> 27) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    if (i < 2 * 7 * 64) {
+      keys[i] = z;
+    } else if (i < 2 * 7 * 64 + 4) {
+      zobrist_castling[i - 2 * 7 * 64] = z;
+    } else if (i < 2 * 7 * 64 + 4 + 8) {
+      zobrist_ep[i - 2 * 7 * 64 - 4] = z;
+    } else {
+      zobrist_side = z;
+    }
+  }
+}
+
+[[nodiscard]] static u64 piece_key(const Position *const pos, const i32 colour,
+                                   const i32 piece, const i32 sq) {
+  return zobrist_pieces[colour ^ pos->flipped][piece][sq ^ 56 * pos->flipped];
+}
+
+[[nodiscard]] static u64 castling_key(const Position *const pos) {
+  u64 key = 0;
+  for (i32 i = 0; i < 4; i++) {
+    if (pos->castling[i]) {
+      key ^= zobrist_castling[i ^ 2 * pos->flipped];
+    }
+  }
+  return key;
+}
+
+[[nodiscard]] static u64 ep_key(const u64 ep) {
+  return ep ? zobrist_ep[lsb(ep) % 8] : 0;
+}
+
+// Full recompute of the incrementally updated key
+[[nodiscard]] static u64 get_key(const Position *const pos) {
+  u64 key = (pos->flipped ? zobrist_side : 0) ^ castling_key(pos) ^
+            ep_key(pos->ep);
+  for (i32 c = 0; c < 2; c++) {
+    for (i32 p = Pawn; p <= King; p++) {
+      u64 copy = pos->colour[c] & pos->pieces[p];
+      while (copy) {
+        key ^= piece_key(pos, c, p, lsb(copy));
+        copy &= copy - 1;
+      }
+    }
+  }
+  return key;
+}
+
+// Approximate key after a move, ignoring castling, en passant and promotions.
+// Good enough to prefetch the child's TT bucket.
+[[nodiscard]] static u64 key_after(const Position *const pos,
+                                   const Move *const move) {
+  const i32 piece = piece_on(pos, move->from);
+  u64 key = pos->key ^ zobrist_side ^ piece_key(pos, 0, piece, move->from) ^
+            piece_key(pos, 0, piece, move->to);
+  if (move->takes_piece != None) {
+    key ^= piece_key(pos, 1, move->takes_piece, move->to);
+  }
+  return key;
+}
+
+// Material plus piece-square value of each piece on each square, from the
+// owner's point of view. Filled by init_psq_table() alongside the eval terms.
+static i32 psq_table[7][64];
+
+static void set_psq(Position *const pos) {
+  for (i32 c = 0; c < 2; c++) {
+    pos->psq[c] = 0;
+    for (i32 p = Pawn; p <= King; p++) {
+      u64 copy = pos->colour[c] & pos->pieces[p];
+      while (copy) {
+        pos->psq[c] += psq_table[p][lsb(copy) ^ 56 * c];
+        copy &= copy - 1;
+      }
+    }
+  }
+}
+
+// Sets up a position from the board, side, castling, en passant and halfmove
+// clock fields of a FEN. The fullmove number is ignored.
+static void set_fen(Position *const restrict pos, const char *restrict fen) {
+  *pos = (Position){0};
+  for (i32 sq = 56; *fen && *fen != ' '; fen++) {
+    if (*fen == '/') {
+      sq -= 16;
+    } else if (*fen >= '1' && *fen <= '8') {
+      sq += *fen - '0';
+    } else {
+      const char lower = *fen | 0x20;
+      for (i32 p = Pawn; p <= King; p++) {
+        if (lower == " pnbrqk"[p]) {
+          pos->pieces[p] |= 1ull << sq;
+          pos->colour[*fen == lower] |= 1ull << sq;
+        }
+      }
+      sq++;
+    }
+  }
+
+  const bool black = fen[0] && fen[1] == 'b';
+  fen += fen[0] ? 3 : 0;
+  for (; *fen && *fen != ' '; fen++) {
+    for (i32 i = 0; i < 4; i++) {
+      pos->castling[i] |= *fen == "KQkq"[i];
+    }
+  }
+
+  if (*fen && fen[1] >= 'a' && fen[1] <= 'h') {
+    pos->ep = 1ull << ((fen[2] - '1') * 8 + fen[1] - 'a');
+  }
+
+  // The halfmove clock, if the field after en passant is one
+  for (fen += *fen != 0; *fen && *fen != ' '; fen++) {
+  }
+  for (fen += *fen != 0; *fen >= '0' && *fen <= '9'; fen++) {
+    pos->halfmove = pos->halfmove * 10 + *fen - '0';
+  }
+
+  if (black) {
+    flip_pos(pos);
+  }
+  pos->key = get_key(pos);
+  set_psq(pos);
+}
+#endif
+
+#ifdef FULL
+// Optional NNUE evaluation: a (768 -> 256) x 2 -> 1 network with clipped ReLU,
+// in the raw little endian i16 layout of the usual trainers. The input is each
+// piece by colour relative to the viewing side, type and square seen from that
+// side, and the hidden layer is kept as one accumulator per side.
+enum { nnue_inputs = 768, nnue_scale = 400, nnue_qa = 255, nnue_qb = 64 };
+// Evaluations stay well clear of mate scores
+enum { nnue_stack_size = 128, nnue_max_eval = 15000 };
+
+typedef struct [[nodiscard]] __attribute__((aligned(64))) {
+  i16 feature_weights[nnue_inputs][nnue_hidden];
+  i16 feature_bias[nnue_hidden];
+  i16 output_weights[2][nnue_hidden];
+  i16 output_bias;
+} NnueNet;
+
+enum { nnue_file_size = __builtin_offsetof(NnueNet, output_bias) + 2 };
+
+static NnueNet nnue_net;
+static bool nnue_loaded;
+static bool nnue_option;
+static bool use_nnue;
+
+// Accumulators of the positions along the line being searched. A position
+// points at its own, and each move writes the next one.
+static per_thread Accumulator nnue_stack[nnue_stack_size];
+
+#ifdef EVALFILE
+// Network embedded at build time
+asm(".section .rodata\n"
+    ".balign 64\n"
+    "nnue_embedded:\n"
+    ".incbin \"" EVALFILE "\"\n"
+    "nnue_embedded_end:\n"
+    ".previous\n");
+extern const u8 nnue_embedded[];
+extern const u8 nnue_embedded_end[];
+#endif
+
+static bool nnue_load(const u8 *const data, const size_t size) {
+  if (size < nnue_file_size) {
+    return false;
+  }
+  __builtin_memcpy(&nnue_net, data, nnue_file_size);
+  nnue_loaded = true;
+  use_nnue = nnue_option;
+  return true;
+}
+
+[[nodiscard]] static i32 nnue_feature(const Position *const pos,
+                                      const i32 view, const i32 side,
+                                      const i32 piece, const i32 sq) {
+  return ((side ^ pos->flipped) != view) * 384 + (piece - 1) * 64 +
+         (sq ^ 56 * (pos->flipped ^ view));
+}
+
+static void nnue_refresh(const Position *const pos,
+                         Accumulator *const accumulator) {
+  for (i32 view = 0; view < 2; view++) {
+    i16 *const values = accumulator->values[view];
+    __builtin_memcpy(values, nnue_net.feature_bias, sizeof(i16) * nnue_hidden);
+    for (i32 side = 0; side < 2; side++) {
+      for (i32 p = Pawn; p <= King; p++) {
+        for (u64 bb = pos->colour[side] & pos->pieces[p]; bb; bb &= bb - 1) {
+          const i16 *const weights =
+              nnue_net.feature_weights[nnue_feature(pos, view, side, p,
+                                                    lsb(bb))];
+          for (i32 i = 0; i < nnue_hidden; i++) {
+            values[i] += weights[i];
+          }
+        }
+      }
+    }
+  }
+}
+
+// Writes the accumulator after a move, before the move is played. Every move
+// adds at most two features and removes at most two, so absent ones read a
+// row of zeros and the update is a single pass.
+static void nnue_play(Position *const restrict pos,
+                      const Move *const restrict move, const i32 piece) {
+  static const i16 zeros[nnue_hidden];
+  Accumulator *const next = pos->accumulator + 1;
+  if (next == nnue_stack + nnue_stack_size) {
+    pos->accumulator = NULL;
+    return;
+  }
+
+  i32 added[2][2] = {{-1, -1}, {-1, -1}};
+  i32 removed[2][2] = {{-1, -1}, {-1, -1}};
+  for (i32 view = 0; view < 2; view++) {
+    added[view][0] = nnue_feature(
+        pos, view, 0, move->promo ? move->promo : piece, move->to);
+    removed[view][0] = nnue_feature(pos, view, 0, piece, move->from);
+    if (move->takes_piece != None) {
+      removed[view][1] =
+          nnue_feature(pos, view, 1, move->takes_piece, move->to);
+    } else if (piece == Pawn && 1ull << move->to == pos->ep) {
+      removed[view][1] = nnue_feature(pos, view, 1, Pawn, move->to - 8);
+    } else if (piece == King && move->to - move->from == 2) {
+      added[view][1] = nnue_feature(pos, view, 0, Rook, 5);
+      removed[view][1] = nnue_feature(pos, view, 0, Rook, 7);
+    } else if (piece == King && move->from - move->to == 2) {
+      added[view][1] = nnue_feature(pos, view, 0, Rook, 3);
+      removed[view][1] = nnue_feature(pos, view, 0, Rook, 0);
+    }
+  }
+
+  for (i32 view = 0; view < 2; view++) {
+    const i16 *const in = pos->accumulator->values[view];
+    i16 *const out = next->values[view];
+    const i16 *const add0 = nnue_net.feature_weights[added[view][0]];
+    const i16 *const add1 = added[view][1] < 0
+                                ? zeros
+                                : nnue_net.feature_weights[added[view][1]];
+    const i16 *const sub0 = nnue_net.feature_weights[removed[view][0]];
+    const i16 *const sub1 = removed[view][1] < 0
+                                ? zeros
+                                : nnue_net.feature_weights[removed[view][1]];
+    for (i32 i = 0; i < nnue_hidden; i++) {
+      out[i] = in[i] + add0[i] + add1[i] - sub0[i] - sub1[i];
+    }
+  }
+  pos->accumulator = next;
+}
+
+// Sum of clipped ReLU activations times the output weights
+[[nodiscard]] static i32 nnue_dot(const i16 *const restrict values,
+                                  const i16 *const restrict weights) {
+#ifdef __AVX2__
+  typedef i16 __attribute__((__vector_size__(32))) i16x16;
+  typedef i32 __attribute__((__vector_size__(32))) i32x8;
+  const i16x16 zero = {0};
+  const i16x16 limit = zero + nnue_qa;
+  i32x8 sum = {0};
+  for (i32 i = 0; i < nnue_hidden; i += 16) {
+    i16x16 value;
+    i16x16 weight;
+    __builtin_memcpy(&value, values + i, sizeof value);
+    __builtin_memcpy(&weight, weights + i, sizeof weight);
+    value = __builtin_ia32_pminsw256(__builtin_ia32_pmaxsw256(value, zero),
+                                     limit);
+    sum += __builtin_ia32_pmaddwd256(value, weight);
+  }
+  return sum[0] + sum[1] + sum[2] + sum[3] + sum[4] + sum[5] + sum[6] +
+         sum[7];
+#else
+  i32 sum = 0;
+  for (i32 i = 0; i < nnue_hidden; i++) {
+    const i32 value = values[i] < 0         ? 0
+                      : values[i] > nnue_qa ? nnue_qa
+                                            : values[i];
+    sum += value * weights[i];
+  }
+  return sum;
+#endif
+}
+
+[[nodiscard]] static i32 nnue_eval(const Position *const pos) {
+  Accumulator scratch;
+  const Accumulator *accumulator = pos->accumulator;
+  if (!accumulator) {
+    nnue_refresh(pos, &scratch);
+    accumulator = &scratch;
+  }
+#ifdef ASSERTS
+  nnue_refresh(pos, &scratch);
+  assert(!memcmp(&scratch, accumulator, sizeof scratch));
+#endif
+  const i32 sum =
+      nnue_dot(accumulator->values[pos->flipped], nnue_net.output_weights[0]) +
+      nnue_dot(accumulator->values[!pos->flipped], nnue_net.output_weights[1]) +
+      nnue_net.output_bias;
+  const i32 score = sum * nnue_scale / (nnue_qa * nnue_qb);
+  return score < -nnue_max_eval  ? -nnue_max_eval
+         : score > nnue_max_eval ? nnue_max_eval
+                                 : score;
+}
+#endif
+
+#ifdef FULL
+// Plays a move already known to be legal
+static void play_move(Position *const restrict pos,
+                      const Move *const restrict move) {
+#else
 i32 makemove(Position *const restrict pos, const Move *const restrict move) {
+#endif
   assert(move->from >= 0);
   assert(move->from < 64);
   assert(move->to >= 0);
@@ -523,10 +1113,26 @@ i32 makemove(Position *const restrict pos, const Move *const restrict move) {
   const i32 piece = piece_on(pos, move->from);
   assert(piece != None);
 
+#ifdef FULL
+  if (pos->accumulator) {
+    nnue_play(pos, move, piece);
+  }
+  pos->key ^= zobrist_side ^ castling_key(pos) ^ ep_key(pos->ep) ^
+              piece_key(pos, 0, piece, move->from) ^
+              piece_key(pos, 0, piece, move->to);
+  pos->psq[0] += psq_table[piece][move->to] - psq_table[piece][move->from];
+  pos->halfmove =
+      piece == Pawn || move->takes_piece != None ? 0 : pos->halfmove + 1;
+#endif
+
   // Captures
   if (move->takes_piece != None) {
     pos->colour[1] ^= to;
     pos->pieces[move->takes_piece] ^= to;
+#ifdef FULL
+    pos->key ^= piece_key(pos, 1, move->takes_piece, move->to);
+    pos->psq[1] -= psq_table[move->takes_piece][move->to ^ 56];
+#endif
   }
 
   // Castling
@@ -536,6 +1142,14 @@ i32 makemove(Position *const restrict pos, const Move *const restrict move) {
                                                 : 0;
     pos->colour[0] ^= bb;
     pos->pieces[Rook] ^= bb;
+#ifdef FULL
+    if (bb) {
+      pos->key ^= piece_key(pos, 0, Rook, lsb(bb)) ^
+                  piece_key(pos, 0, Rook, 63 - __builtin_clzll(bb));
+      pos->psq[0] += bb == 0xa0 ? psq_table[Rook][5] - psq_table[Rook][7]
+                                : psq_table[Rook][3] - psq_table[Rook][0];
+    }
+#endif
   }
 
   // Move the piece
@@ -546,6 +1160,10 @@ i32 makemove(Position *const restrict pos, const Move *const restrict move) {
   if (piece == Pawn && to == pos->ep) {
     pos->colour[1] ^= to >> 8;
     pos->pieces[Pawn] ^= to >> 8;
+#ifdef FULL
+    pos->key ^= piece_key(pos, 1, Pawn, move->to - 8);
+    pos->psq[1] -= psq_table[Pawn][move->to - 8 ^ 56];
+#endif
   }
   pos->ep = 0;
 
@@ -558,6 +1176,12 @@ i32 makemove(Position *const restrict pos, const Move *const restrict move) {
   if (move->promo != None) {
     pos->pieces[Pawn] ^= to;
     pos->pieces[move->promo] ^= to;
+#ifdef FULL
+    pos->key ^= piece_key(pos, 0, Pawn, move->to) ^
+                piece_key(pos, 0, move->promo, move->to);
+    pos->psq[0] +=
+        psq_table[move->promo][move->to] - psq_table[Pawn][move->to];
+#endif
   }
 
   // Update castling permissions
@@ -566,8 +1190,16 @@ i32 makemove(Position *const restrict pos, const Move *const restrict move) {
   pos->castling[0] &= !(mask & 0x90ull);
   pos->castling[1] &= !(mask & 0x11ull);
 
+#ifdef FULL
+  pos->key ^= castling_key(pos) ^ ep_key(pos->ep);
+#endif
+
   flip_pos(pos);
 
+#ifdef FULL
+  assert(pos->key == get_key(pos));
+#endif
+
   assert(!(pos->colour[0] & pos->colour[1]));
   assert(!(pos->pieces[Pawn] & pos->pieces[Knight]));
   assert(!(pos->pieces[Pawn] & pos->pieces[Bishop]));
@@ -585,6 +1217,13 @@ i32 makemove(Position *const restrict pos, const Move *const restrict move) {
   assert(!(pos->pieces[Rook] & pos->pieces[King]));
   assert(!(pos->pieces[Queen] & pos->pieces[King]));
 
+#ifdef FULL
+}
+
+i32 makemove(Position *const restrict pos, const Move *const restrict move) {
+  play_move(pos, move);
+#endif
+
   // Return move legality
   return !is_attacked(pos, lsb(pos->colour[1] & pos->pieces[King]), false);
 }
@@ -693,19 +1332,364 @@ enum { max_moves = 218 };
   return num_moves;
 }
 
-#pragma endregion
-
-#pragma region engine
+#ifdef FULL
+// Checkers and pinned pieces of the side to move, worked out once per node so
+// the generators below emit only legal moves and none has to be made to find
+// out
+typedef struct [[nodiscard]] {
+  u64 checkers;
+  u64 pinned;
+  // Destinations that deal with a single check, or every square when not in
+  // check
+  u64 evasions;
+  i32 king_sq;
+} MoveMasks;
+
+// Pieces of the side not to move that attack sq, given the occupancy
+[[nodiscard]] static u64 attackers_to(const Position *const restrict pos,
+                                      const i32 sq, const u64 occupied) {
+  const u64 bb = 1ull << sq;
+  return ((nw(bb) | ne(bb)) & pos->pieces[Pawn] |
+          knight(sq) & pos->pieces[Knight] |
+          bishop(sq, occupied) & (pos->pieces[Bishop] | pos->pieces[Queen]) |
+          rook(sq, occupied) & (pos->pieces[Rook] | pos->pieces[Queen]) |
+          king(sq) & pos->pieces[King]) &
+         pos->colour[1] & occupied;
+}
 
-[[nodiscard]] static u64 perft(const Position *const restrict pos,
-                               const i32 depth) {
-  if (depth == 0) {
-    return 1;
+// Squares strictly between two squares on a shared line, otherwise none
+[[nodiscard]] static u64 between(const i32 a, const i32 b) {
+  const u64 bb = 1ull << b;
+  if (rook(a, 0) & bb) {
+    return rook(a, bb) & rook(b, 1ull << a);
+  }
+  if (bishop(a, 0) & bb) {
+    return bishop(a, bb) & bishop(b, 1ull << a);
   }
+  return 0;
+}
 
-  u64 nodes = 0;
-  Move moves[max_moves];
-  const i32 num_moves = movegen(pos, moves, false);
+// The whole line through two aligned squares
+[[nodiscard]] static u64 line_through(const i32 a, const i32 b) {
+  const u64 bb = 1ull << b;
+  if (rook(a, 0) & bb) {
+    return rook(a, 0) & (rook(b, 0) | bb) | 1ull << a;
+  }
+  return bishop(a, 0) & (bishop(b, 0) | bb) | 1ull << a;
+}
+
+[[nodiscard]] static MoveMasks get_masks(const Position *const restrict pos) {
+  const u64 all = pos->colour[0] | pos->colour[1];
+  MoveMasks masks = {.king_sq = lsb(pos->colour[0] & pos->pieces[King]),
+                     .evasions = ~0ull};
+  masks.checkers = attackers_to(pos, masks.king_sq, all);
+  if (masks.checkers) {
+    masks.evasions =
+        masks.checkers & (masks.checkers - 1)
+            ? 0
+            : masks.checkers | between(masks.king_sq, lsb(masks.checkers));
+  }
+
+  // Sliders that would attack the king if not for exactly one of our pieces
+  u64 snipers =
+      (rook(masks.king_sq, pos->colour[1]) &
+           (pos->pieces[Rook] | pos->pieces[Queen]) |
+       bishop(masks.king_sq, pos->colour[1]) &
+           (pos->pieces[Bishop] | pos->pieces[Queen])) &
+      pos->colour[1];
+  while (snipers) {
+    const u64 blockers = between(masks.king_sq, lsb(snipers)) & all;
+    snipers &= snipers - 1;
+    if (blockers && !(blockers & (blockers - 1))) {
+      masks.pinned |= blockers;
+    }
+  }
+  return masks;
+}
+
+// Whether a pseudo-legal move leaves the king safe
+[[nodiscard]] static bool is_legal(const Position *const restrict pos,
+                                   const MoveMasks *const restrict masks,
+                                   const Move *const restrict move) {
+  const u64 all = pos->colour[0] | pos->colour[1];
+  const u64 to = 1ull << move->to;
+  if (move->from == masks->king_sq) {
+    if (move->to - move->from == 2 || move->from - move->to == 2) {
+      return !masks->checkers && !attackers_to(pos, move->to, all);
+    }
+    return !attackers_to(pos, move->to, all ^ 1ull << move->from);
+  }
+  if (to == pos->ep && piece_on(pos, move->from) == Pawn) {
+    return !attackers_to(pos, masks->king_sq,
+                         all ^ 1ull << move->from ^ to ^ to >> 8);
+  }
+  return masks->evasions & to &&
+         (!(masks->pinned >> move->from & 1) ||
+          line_through(masks->king_sq, move->from) & to);
+}
+
+// Drops the pawn moves that leave the line of a pin
+static Move *filter_pinned(const MoveMasks *const restrict masks,
+                           Move *restrict start, Move *const restrict end) {
+  Move *kept = start;
+  for (; start < end; start++) {
+    if (!(masks->pinned >> start->from & 1) ||
+        line_through(masks->king_sq, start->from) >> start->to & 1) {
+      *kept++ = *start;
+    }
+  }
+  return kept;
+}
+
+// Knight, bishop, rook and queen moves, kept on the line of any pin
+static Move *generate_legal_piece_moves(const Position *const restrict pos,
+                                        const MoveMasks *const restrict masks,
+                                        Move *restrict movelist,
+                                        const u64 to_mask) {
+  for (i32 piece = Knight; piece < King; piece++) {
+    u64 copy = pos->colour[0] & pos->pieces[piece];
+    while (copy) {
+      const u8 from = lsb(copy);
+      copy &= copy - 1;
+
+      u64 moves = get_mobility(from, piece, pos) & to_mask;
+      if (masks->pinned >> from & 1) {
+        moves &= line_through(masks->king_sq, from);
+      }
+
+      while (moves) {
+        const u8 to = lsb(moves);
+        moves &= moves - 1;
+        *movelist++ = (Move){.from = from,
+                             .to = to,
+                             .promo = None,
+                             .takes_piece = piece_on(pos, to)};
+      }
+    }
+  }
+
+  return movelist;
+}
+
+// Legal captures and promotions, the moves searched in quiescence
+[[nodiscard]] static i32 generate_noisy(const Position *const restrict pos,
+                                        const MoveMasks *const restrict masks,
+                                        Move *restrict movelist) {
+  const Move *start = movelist;
+  const u64 all = pos->colour[0] | pos->colour[1];
+  const u64 pawns = pos->colour[0] & pos->pieces[Pawn];
+  const u64 king_bb = 1ull << masks->king_sq;
+
+  u64 king_moves = king(masks->king_sq) & pos->colour[1];
+  while (king_moves) {
+    const u8 to = lsb(king_moves);
+    king_moves &= king_moves - 1;
+    if (!attackers_to(pos, to, all ^ king_bb)) {
+      *movelist++ = (Move){.from = masks->king_sq,
+                           .to = to,
+                           .promo = None,
+                           .takes_piece = piece_on(pos, to)};
+    }
+  }
+  if (!masks->evasions) {
+    return movelist - start;
+  }
+
+  Move *const pawn_moves = movelist;
+  movelist = generate_pawn_moves(
+      pos, movelist,
+      north(pawns) & ~all & 0xFF00000000000000ull & masks->evasions, -8);
+  movelist = generate_pawn_moves(
+      pos, movelist, nw(pawns) & pos->colour[1] & masks->evasions, -7);
+  movelist = generate_pawn_moves(
+      pos, movelist, ne(pawns) & pos->colour[1] & masks->evasions, -9);
+  movelist = filter_pinned(masks, pawn_moves, movelist);
+  movelist = generate_legal_piece_moves(pos, masks, movelist,
+                                        pos->colour[1] & masks->evasions);
+
+  // En passant can uncover the king along a rank, or remove the checker, so
+  // it is checked against the board as it would be after the capture
+  if (pos->ep) {
+    const i32 to = lsb(pos->ep);
+    u64 capturers = (sw(pos->ep) | se(pos->ep)) & pawns;
+    while (capturers) {
+      const i32 from = lsb(capturers);
+      capturers &= capturers - 1;
+      if (!attackers_to(pos, masks->king_sq,
+                        all ^ 1ull << from ^ pos->ep ^ pos->ep >> 8)) {
+        *movelist++ = (Move){
+            .from = from, .to = to, .promo = None, .takes_piece = None};
+      }
+    }
+  }
+  return movelist - start;
+}
+
+// Legal moves that generate_noisy leaves out
+[[nodiscard]] static i32 generate_quiet(const Position *const restrict pos,
+                                        const MoveMasks *const restrict masks,
+                                        Move *restrict movelist) {
+  const Move *start = movelist;
+  const u64 all = pos->colour[0] | pos->colour[1];
+  const u64 pawns = pos->colour[0] & pos->pieces[Pawn];
+  const u64 king_bb = 1ull << masks->king_sq;
+
+  u64 king_moves = king(masks->king_sq) & ~all;
+  while (king_moves) {
+    const u8 to = lsb(king_moves);
+    king_moves &= king_moves - 1;
+    if (!attackers_to(pos, to, all ^ king_bb)) {
+      *movelist++ = (Move){.from = masks->king_sq,
+                           .to = to,
+                           .promo = None,
+                           .takes_piece = None};
+    }
+  }
+  if (!masks->evasions) {
+    return movelist - start;
+  }
+
+  if (!masks->checkers) {
+    if (pos->castling[0] && !(all & 0x60ull) && !attackers_to(pos, 5, all) &&
+        !attackers_to(pos, 6, all)) {
+      *movelist++ =
+          (Move){.from = 4, .to = 6, .promo = None, .takes_piece = None};
+    }
+    if (pos->castling[1] && !(all & 0xEull) && !attackers_to(pos, 3, all) &&
+        !attackers_to(pos, 2, all)) {
+      *movelist++ =
+          (Move){.from = 4, .to = 2, .promo = None, .takes_piece = None};
+    }
+  }
+
+  Move *const pawn_moves = movelist;
+  movelist = generate_pawn_moves(
+      pos, movelist,
+      north(north(pawns & 0xFF00) & ~all) & ~all & masks->evasions, -16);
+  movelist = generate_pawn_moves(
+      pos, movelist,
+      north(pawns) & ~all & ~0xFF00000000000000ull & masks->evasions, -8);
+  movelist = filter_pinned(masks, pawn_moves, movelist);
+  movelist =
+      generate_legal_piece_moves(pos, masks, movelist, ~all & masks->evasions);
+  return movelist - start;
+}
+
+// All legal moves
+[[nodiscard]] static i32 movegen_legal(const Position *const restrict pos,
+                                       Move *restrict movelist) {
+  const MoveMasks masks = get_masks(pos);
+  const i32 num_noisy = generate_noisy(pos, &masks, movelist);
+  const i32 num_moves =
+      num_noisy + generate_quiet(pos, &masks, movelist + num_noisy);
+  assert(num_moves < max_moves);
+
+#ifdef ASSERTS
+  Move pseudo[max_moves];
+  const i32 num_pseudo = movegen(pos, pseudo, false);
+  i32 num_legal = 0;
+  for (i32 i = 0; i < num_pseudo; i++) {
+    Position npos = *pos;
+    num_legal += makemove(&npos, &pseudo[i]);
+  }
+  assert(num_moves == num_legal);
+#endif
+
+  return num_moves;
+}
+
+// Whether movegen would generate the move, for moves that come from the TT
+// or the killer slot rather than from the generator
+[[nodiscard]] static bool is_pseudo_legal(const Position *const restrict pos,
+                                          const Move *const restrict move) {
+  // The killer slot of a fresh stack entry holds whatever was there before
+  if ((move->from | move->to) > 63) {
+    return false;
+  }
+
+  const u64 from = 1ull << move->from;
+  const u64 to = 1ull << move->to;
+  const u64 all = pos->colour[0] | pos->colour[1];
+  if (!(pos->colour[0] & from) || pos->colour[0] & to ||
+      move->takes_piece != piece_on(pos, move->to)) {
+    return false;
+  }
+
+  const i32 piece = piece_on(pos, move->from);
+  if (piece == Pawn) {
+    if ((move->to > 55) != (move->promo != None) ||
+        (move->promo != None && move->promo < Knight) || move->promo > Queen) {
+      return false;
+    }
+    return (north(from) & ~all | north(north(from & 0xFF00) & ~all) & ~all |
+            (nw(from) | ne(from)) & (pos->colour[1] | pos->ep)) &
+           to;
+  }
+  if (move->promo != None) {
+    return false;
+  }
+  if (piece == King && move->from == 4 && (move->to == 6 || move->to == 2)) {
+    return move->to == 6
+               ? pos->castling[0] && !(all & 0x60ull) &&
+                     !is_attacked(pos, 4, true) && !is_attacked(pos, 5, true)
+               : pos->castling[1] && !(all & 0xEull) &&
+                     !is_attacked(pos, 4, true) && !is_attacked(pos, 3, true);
+  }
+  return get_mobility(move->from, piece, pos) & to;
+}
+#endif
+
+#pragma endregion
+
+#pragma region engine
+
+#ifdef FULL
+// Perft counts by key and depth, so transpositions are only walked once. The
+// check word is stored folded with the count so that an entry torn by two
+// threads storing at once fails to match.
+typedef struct [[nodiscard]] {
+  u64 check;
+  u64 nodes;
+} PerftEntry;
+
+enum { perft_tt_length = 1 << 20 };
+
+static PerftEntry perft_tt[perft_tt_length];
+#endif
+
+[[nodiscard]] static u64 perft(const Position *const restrict pos,
+                               const i32 depth) {
+  if (depth == 0) {
+    return 1;
+  }
+
+  u64 nodes = 0;
+  Move moves[max_moves];
+#ifdef FULL
+  const i32 num_moves = movegen_legal(pos, moves);
+
+  // BULK COUNTING
+  if (depth == 1) {
+    return num_moves;
+  }
+
+  // PERFT HASH
+  PerftEntry *const entry = &perft_tt[pos->key % perft_tt_length];
+  const u64 check = pos->key ^ depth * 0x9E3779B97F4A7C15ull;
+  const PerftEntry snapshot = *entry;
+  if ((snapshot.check ^ snapshot.nodes) == check) {
+    return snapshot.nodes;
+  }
+
+  for (i32 i = 0; i < num_moves; ++i) {
+    Position npos = *pos;
+    play_move(&npos, &moves[i]);
+    nodes += perft(&npos, depth - 1);
+  }
+
+  *entry = (PerftEntry){.check = check ^ nodes, .nodes = nodes};
+#else
+  const i32 num_moves = movegen(pos, moves, false);
 
   for (i32 i = 0; i < num_moves; ++i) {
     Position npos = *pos;
@@ -717,6 +1701,7 @@ enum { max_moves = 218 };
 
     nodes += perft(&npos, depth - 1);
   }
+#endif
 
   return nodes;
 }
@@ -782,18 +1767,87 @@ static i32 eval(Position *const restrict pos) {
   return score;
 }
 
+#ifdef FULL
+static void init_psq_table() {
+  for (i32 p = Pawn; p <= King; p++) {
+    for (i32 sq = 0; sq < 64; sq++) {
+      psq_table[p][sq] = material[p - 1] + pst_rank[(p - 1) * 8 + (sq >> 3)] +
+                         pst_file[(p - 1) * 8 + (sq & 7)];
+    }
+  }
+}
+
+// Same score as eval(), with the material and piece-square terms taken from
+// the sums makemove keeps in Position. Only the bishop pair and the pawn
+// dependent open file terms are computed here, without flipping the board.
+[[nodiscard]] static i32 eval_incremental(Position *const restrict pos) {
+  i32 score = 16 + pos->psq[0] - pos->psq[1];
+  for (i32 c = 0; c < 2; c++) {
+    const u64 own = pos->colour[c];
+    i32 side = 0;
+
+    // BISHOP PAIR
+    if (count(own & pos->pieces[Bishop]) > 1) {
+      side += bishop_pair;
+    }
+
+    // OPEN FILES / DOUBLED PAWNS
+    // Squares with one of their own pawns further up the file, which for the
+    // other side is further down the board
+    u64 covered = own & pos->pieces[Pawn];
+    if (c) {
+      covered = north(covered);
+      covered |= covered << 8;
+      covered |= covered << 16;
+      covered |= covered << 32;
+    } else {
+      covered = south(covered);
+      covered |= covered >> 8;
+      covered |= covered >> 16;
+      covered |= covered >> 32;
+    }
+    for (i32 p = Pawn; p <= King; p++) {
+      side += open_files[p - 1] * count(own & pos->pieces[p] & ~covered);
+    }
+
+    score += c ? -side : side;
+  }
+  assert(score == eval(pos));
+  return score;
+}
+#endif
+
 enum { max_ply = 96 };
 enum { mate = 30000, inf = 32000 };
 
+#ifdef HOSTED
+// Moved on by ponderhit on the UCI thread while the search reads it
+static atomic_size_t start_time;
+#else
 static size_t start_time;
+#endif
+#ifndef FULL
 static size_t max_time;
+#else
+enum { max_key_history = 1024 + max_ply };
+
+// Keys of the game since the last capture or pawn move, then of the line being
+// searched, so repetitions are looked for in one dense array
+static per_thread u64 key_history[max_key_history];
+#endif
 
 typedef struct [[nodiscard]] {
   i32 num_moves;
+#ifndef FULL
   u64 position_hash;
+#endif
   Move best_move;
   Move killer;
   Move moves[max_moves];
+#ifdef HOSTED
+  // Whether the move into this ply was a capture or a pawn move
+  bool zeroing;
+#endif
 } SearchStack;
 
 typedef struct [[nodiscard]] __attribute__((packed)) {
@@ -804,401 +1858,4386 @@ typedef struct [[nodiscard]] __attribute__((packed)) {
   u8 flag;
 } TTEntry;
 
-enum { tt_length = 64 * 1024 * 1024 / sizeof(TTEntry) };
-
 enum { Upper = 0, Lower = 1, Exact = 2 };
 
-static TTEntry tt[tt_length];
-static i32 move_history[2][6][64][64];
-
-#if defined(__x86_64__) || defined(_M_X64)
-typedef long long __attribute__((__vector_size__(16))) i128;
+#ifdef FULL
+// One bucket per cache line, so a probe costs a single fetch
+enum { bucket_entries = 6 };
 
-[[nodiscard]] __attribute__((target("aes"))) u64
-get_hash(const Position *const pos) {
-  i128 hash = {0};
+typedef struct [[nodiscard]] __attribute__((aligned(64))) {
+  TTEntry entries[bucket_entries];
+} TTBucket;
 
-  // USE 16 BYTE POSITION SEGMENTS AS KEYS FOR AES
-  const u8 *const data = (const u8 *)pos;
-  for (i32 i = 0; i < 5; i++) {
-    i128 key;
-    __builtin_memcpy(&key, data + i * 16, 16);
-    hash = __builtin_ia32_aesenc128(hash, key);
-  }
+// Generation of the current search, stored above the bound in each entry's
+// flag. Never zero, so an empty entry is one with a zero flag.
+enum { age_bits = 6, age_mask = (1 << age_bits) - 1 };
+static u8 tt_age;
+#endif
 
-  // FINAL ROUND FOR BIT MIXING
-  hash = __builtin_ia32_aesenc128(hash, hash);
+#ifdef HOSTED
+static TTBucket *tt;
+static size_t tt_length;
+static size_t tt_size;
+#elif defined(FULL)
+enum { tt_length = 64 * 1024 * 1024 / sizeof(TTBucket) };
 
-  // USE FIRST 64 BITS AS POSITION HASH
-  return hash[0];
-}
-#elif defined(__aarch64__)
+static TTBucket tt[tt_length];
+#else
+enum { tt_length = 64 * 1024 * 1024 / sizeof(TTEntry) };
 
-#include <arm_neon.h>
+static TTEntry tt[tt_length];
+#endif
+static per_thread i32 move_history[2][6][64][64];
 
-[[nodiscard]] __attribute__((target("+aes"))) u64
-get_hash(const Position *const pos) {
-  uint8x16_t hash = vdupq_n_u8(0);
+#ifdef FULL
+[[nodiscard]] static TTBucket *tt_bucket(const u64 hash) {
+  return &tt[(unsigned __int128)hash * tt_length >> 64];
+}
 
-  // USE 16 BYTE POSITION SEGMENTS AS KEYS FOR AES
-  const u8 *const data = (const u8 *)pos;
-  for (i32 i = 0; i < 5; ++i) {
-    uint8x16_t key;
-    memcpy(&key, data + i * 16, 16);
+// Entries are read and written without locks by every search thread, so the
+// partial hash is stored folded with the rest of the entry. An entry torn by
+// concurrent stores then fails the partial hash comparison.
+[[nodiscard]] static u16 tt_checksum(const TTEntry *const entry) {
+  u32 move;
+  __builtin_memcpy(&move, &entry->move, sizeof(move));
+  const u64 data = move | (u64)(u16)entry->score << 32 |
+                   (u64)(u8)entry->depth << 48 | (u64)entry->flag << 56;
+  return data ^ data >> 16 ^ data >> 32 ^ data >> 48;
+}
 
-    hash = vaesmcq_u8(vaeseq_u8(hash, vdupq_n_u8(0)));
-    hash = veorq_u8(hash, key);
+[[nodiscard]] static TTEntry tt_load(const TTBucket *const bucket,
+                                     const u16 partial_hash) {
+  for (i32 i = 0; i < bucket_entries; i++) {
+    TTEntry entry = bucket->entries[i];
+    entry.partial_hash ^= tt_checksum(&entry);
+    if (entry.partial_hash == partial_hash && entry.flag) {
+      entry.flag &= 3;
+      return entry;
+    }
   }
+  return (TTEntry){.partial_hash = ~partial_hash};
+}
 
-  // FINAL ROUND FOR BIT MIXING
-  uint8x16_t key = hash;
-  hash = vaesmcq_u8(vaeseq_u8(hash, vdupq_n_u8(0)));
-  hash = veorq_u8(hash, key);
-
-  // USE FIRST 64 BITS AS POSITION HASH
-  u64 result;
-  memcpy(&result, &hash, sizeof(result));
-  return result;
+[[nodiscard]] static i32 tt_age_of(const TTEntry *const entry) {
+  return (tt_age - (entry->flag >> 2)) & age_mask;
 }
 
-#else
-#error "Unsupported architecture: get_hash only for x86_64 and aarch64"
-#endif
+// Replaces the entry of the same position unless it is from this search and
+// much deeper, otherwise the shallowest and oldest entry in the bucket
+static void tt_save(TTBucket *const bucket, TTEntry entry) {
+  TTEntry *slot = &bucket->entries[0];
+  i32 slot_value = inf;
+  for (i32 i = 0; i < bucket_entries; i++) {
+    TTEntry *const candidate = &bucket->entries[i];
+    if ((candidate->partial_hash ^ tt_checksum(candidate)) ==
+            entry.partial_hash &&
+        candidate->flag) {
+      if (entry.flag != Exact && !tt_age_of(candidate) &&
+          entry.depth + 2 < candidate->depth) {
+        return;
+      }
+      slot = candidate;
+      break;
+    }
+    const i32 value =
+        candidate->flag ? candidate->depth - 8 * tt_age_of(candidate) : -inf;
+    if (value < slot_value) {
+      slot_value = value;
+      slot = candidate;
+    }
+  }
+  entry.flag |= tt_age << 2;
+  entry.partial_hash ^= tt_checksum(&entry);
+  *slot = entry;
+}
 
-static i16 search(Position *const restrict pos, const i32 ply, i32 depth,
-                  i32 alpha, const i32 beta,
-#ifdef FULL
-                  u64 *nodes,
+// Permille of sampled entries written by the current search
+[[nodiscard]] static i32 hashfull() {
+  i32 used = 0;
+  for (i32 i = 0; i < 1000; i++) {
+    const TTEntry *const entry =
+        &tt[i / bucket_entries].entries[i % bucket_entries];
+    used += entry->flag && !tt_age_of(entry);
+  }
+  return used;
+}
 #endif
-                  SearchStack *restrict stack, const i32 pos_history_count,
-                  const bool do_null) {
-  assert(alpha < beta);
-  assert(ply >= 0);
 
-  const bool in_check =
-      is_attacked(pos, lsb(pos->colour[0] & pos->pieces[King]), true);
+#ifdef HOSTED
+enum { max_threads = 256 };
 
-  // IN-CHECK EXTENSION
-  if (in_check) {
-    depth++;
+typedef struct [[nodiscard]] {
+  pthread_t handle;
+  Position pos;
+  SearchStack *stack;
+  const u64 *keys; // Key history of the game, copied when the thread starts
+  i32 pos_history_count;
+  i32 maxdepth;
+  u64 nodes;
+  i32 depth; // Last fully completed iteration
+  Move best_move;
+} SearchThread;
+
+static SearchThread threads[max_threads];
+static i32 num_threads = 1;
+
+enum { default_hash = 64, max_hash = 65536 };
+
+// File the table is mapped from with HashFile, empty for anonymous memory
+static char tt_file[4096];
+// Bytes mapped ahead of tt, the header of a table file
+static size_t tt_offset;
+
+// HashFile and savehash files are this header followed by whole buckets. The
+// header is a bucket long, which keeps the mapped buckets on cache lines.
+typedef struct [[nodiscard]] __attribute__((aligned(64))) {
+  char magic[8];
+  u32 version;
+  u32 bucket_size;
+  u32 entry_size;
+} TTFileHeader;
+
+static const TTFileHeader tt_file_header = {
+    "4kchash", 1, sizeof(TTBucket), sizeof(TTEntry)};
+
+// Size of the table held by a file of this engine and layout, or 0 for any
+// other file
+[[nodiscard]] static size_t tt_file_size(const i32 fd) {
+  struct stat st;
+  TTFileHeader header;
+  if (fstat(fd, &st) ||
+      (size_t)st.st_size < sizeof header + sizeof(TTBucket) ||
+      (st.st_size - sizeof header) % sizeof(TTBucket) ||
+      pread(fd, &header, sizeof header, 0) != sizeof header ||
+      __builtin_memcmp(&header, &tt_file_header, sizeof header)) {
+    return 0;
   }
+  return st.st_size - sizeof header;
+}
 
-  // EARLY EXITS
-  if (depth > 4 && get_time() - start_time > max_time) {
-    return alpha;
+// Maps the table from tt_file, shared with every other process mapping it, so
+// it outlives the process. An existing table file keeps its size, and a file
+// that is not a table is left untouched.
+[[nodiscard]] static bool map_tt_file(size_t size) {
+  const i32 fd = open(tt_file, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return false;
   }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return false;
+  }
+  if (st.st_size) {
+    size = tt_file_size(fd);
+    if (!size) {
+      printf("info string %s is not a hash file\n", tt_file);
+      close(fd);
+      return false;
+    }
+  } else if (ftruncate(fd, sizeof tt_file_header + size) ||
+             pwrite(fd, &tt_file_header, sizeof tt_file_header, 0) !=
+                 sizeof tt_file_header) {
+    close(fd);
+    return false;
+  }
+  char *const memory = mmap(NULL, sizeof tt_file_header + size,
+                            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+  tt = (TTBucket *)(memory + sizeof tt_file_header);
+  tt_offset = sizeof tt_file_header;
+  tt_size = size;
+  tt_length = tt_size / sizeof(TTBucket);
+  return true;
+}
+
+// Backs the table with explicit huge pages when the system has them reserved,
+// otherwise with transparent huge pages, to save TLB misses on every probe
+static void allocate_tt(const size_t size) {
+  if (tt) {
+    munmap((char *)tt - tt_offset, tt_offset + tt_size);
+  }
+  tt_offset = 0;
+  tt_size = size;
+  if (tt_file[0]) {
+    if (map_tt_file(tt_size)) {
+      return;
+    }
+    printf("info string Cannot map %s, using memory\n", tt_file);
+    tt_file[0] = 0;
+  }
+  while (true) {
+    if (tt_size % (2 * 1024 * 1024) == 0) {
+      tt = mmap(NULL, tt_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (tt != MAP_FAILED) {
+        break;
+      }
+    }
+    tt = mmap(NULL, tt_size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tt != MAP_FAILED) {
+      madvise(tt, tt_size, MADV_HUGEPAGE);
+      break;
+    }
+    printf("info string Hash of %zu MB unavailable\n", tt_size >> 20);
+    // Below 1 MB there is nothing left worth searching with
+    if (tt_size <= 1024 * 1024) {
+      fprintf(stderr, "Cannot allocate a hash table\n");
+      exit(1);
+    }
+    tt_size /= 2;
+  }
+  tt_length = tt_size / sizeof(TTBucket);
+}
+
+static void resize_tt(const size_t megabytes) {
+  allocate_tt(megabytes * 1024 * 1024);
+}
+
+static void *clear_tt_part(void *const arg) {
+  const size_t part = (size_t)arg;
+  const size_t part_size = (tt_size / num_threads + 63) & ~(size_t)63;
+  const size_t start = part * part_size;
+  if (start < tt_size) {
+    __builtin_memset((char *)tt + start, 0,
+                     part_size < tt_size - start ? part_size
+                                                 : tt_size - start);
+  }
+  return NULL;
+}
+#endif
+
+#ifdef FULL
+static void clear_tt() {
+#ifdef HOSTED
+  // Every search thread clears its own share of the table
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_create(&threads[i].handle, NULL, clear_tt_part, (void *)(size_t)i);
+  }
+  clear_tt_part((void *)0);
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_join(threads[i].handle, NULL);
+  }
+#else
+  __builtin_memset(tt, 0, tt_length * sizeof(TTBucket));
+#endif
+  tt_age = 0;
+}
+#endif
+
+#ifdef HOSTED
+// Writes the whole table to a file in the HashFile layout, to be loaded again
+// by loadhash or mapped by HashFile
+static void save_tt(const char *const path) {
+  const i32 fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool saved = fd >= 0 && write(fd, &tt_file_header, sizeof tt_file_header) ==
+                              sizeof tt_file_header;
+  for (size_t done = 0; saved && done < tt_size;) {
+    const ssize_t result = write(fd, (char *)tt + done, tt_size - done);
+    saved = result > 0;
+    done += saved ? result : 0;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!saved) {
+    printf("info string Cannot save the hash to %s\n", path);
+  }
+}
+
+// Reads a table saved by savehash, first resizing the table to match it
+static void load_tt(const char *const path) {
+  const i32 fd = open(path, O_RDONLY);
+  const size_t size = fd < 0 ? 0 : tt_file_size(fd);
+  if (!size) {
+    printf("info string Cannot load the hash from %s\n", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  if (size != tt_size) {
+    allocate_tt(size);
+  }
+  // A HashFile of another size keeps its own
+  if (size != tt_size) {
+    printf("info string %s does not match the size of %s\n", path, tt_file);
+    close(fd);
+    return;
+  }
+  for (size_t done = 0; done < tt_size;) {
+    const ssize_t result = pread(fd, (char *)tt + done, tt_size - done,
+                                 sizeof tt_file_header + done);
+    if (result < 1) {
+      printf("info string Cannot load the hash from %s\n", path);
+      break;
+    }
+    done += result;
+  }
+  close(fd);
+}
+
+// Benchmarks and batch modes clear the table, so while it is kept in a file
+// they run on a private table of the same size, and the file is mapped again
+// once they are done
+static char detached_tt_file[sizeof tt_file];
+
+static void detach_tt_file() {
+  if (tt_file[0]) {
+    __builtin_memcpy(detached_tt_file, tt_file, sizeof tt_file);
+    tt_file[0] = 0;
+    allocate_tt(tt_size);
+  }
+}
+
+static void attach_tt_file() {
+  if (detached_tt_file[0]) {
+    __builtin_memcpy(tt_file, detached_tt_file, sizeof tt_file);
+    detached_tt_file[0] = 0;
+    allocate_tt(tt_size);
+  }
+}
+#endif
+
+#ifdef FULL
+// Set once the search has to end: by the UCI thread, on reaching a limit, or
+// once the main search thread is done. Cleared by whoever starts a search.
+#ifdef HOSTED
+static atomic_bool stop;
+static atomic_bool pondering;
+static bool infinite;
+
+[[nodiscard]] static u64 helper_nodes() {
+  u64 nodes = 0;
+  for (i32 i = 1; i < num_threads; i++) {
+    nodes += __atomic_load_n(&threads[i].nodes, __ATOMIC_RELAXED);
+  }
+  return nodes;
+}
+#else
+static bool stop;
+#endif
+
+typedef struct [[nodiscard]] {
+  size_t soft; // No further iteration is started past this many ms
+  size_t hard; // The search is aborted past this many ms
+  u64 nodes;
+  i32 mate; // Stop on finding a mate in this many moves
+} SearchLimits;
+
+enum { move_overhead = 10, default_moves_to_go = 32, poll_interval = 2048 };
+enum { aspiration_window = 25 };
+
+static const SearchLimits no_limits = {.soft = -1, .hard = -1, .nodes = -1};
+static SearchLimits limits;
+
+// Node count at which the search next checks the clock. Helper threads never
+// do, they only follow the main thread's stop.
+static per_thread u64 next_poll;
+
+// Node count at which this thread's search aborts on its own, without the
+// shared stop, for searches on a budget of their own like datagen's
+static per_thread u64 node_cap = -1;
+
+// Set by callers that only want the result of a search, not its output
+static per_thread bool quiet;
+
+// Nodes spent under each root move since the search started, by from and to
+static per_thread u64 root_move_nodes[64][64];
+
+// The soft limit is a share of the clock plus most of the increment. The hard
+// limit bounds a single iteration running long, and never flags.
+static void set_time_limits(const size_t time, const size_t inc,
+                            const i32 moves_to_go) {
+  const size_t available = time > move_overhead ? time - move_overhead : 1;
+  limits.soft =
+      available / (moves_to_go ? moves_to_go : default_moves_to_go) +
+      inc * 3 / 4;
+  limits.hard = limits.soft * 8 < available * 3 / 4 ? limits.soft * 8
+                                                     : available * 3 / 4;
+  if (limits.soft > limits.hard) {
+    limits.soft = limits.hard;
+  }
+}
+
+static void check_limits(u64 nodes) {
+#ifdef HOSTED
+  if (pondering) {
+    return;
+  }
+  nodes += helper_nodes();
+#endif
+  if (nodes >= limits.nodes || get_time() - start_time > limits.hard) {
+    stop = true;
+  }
+}
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+typedef long long __attribute__((__vector_size__(16))) i128;
+
+[[nodiscard]] __attribute__((target("aes"))) u64
+get_hash(const Position *const pos) {
+  i128 hash = {0};
+
+  // USE 16 BYTE POSITION SEGMENTS AS KEYS FOR AES
+  const u8 *const data = (const u8 *)pos;
+  for (i32 i = 0; i < 5; i++) {
+    i128 key;
+    __builtin_memcpy(&key, data + i * 16, 16);
+    hash = __builtin_ia32_aesenc128(hash, key);
+  }
+
+  // FINAL ROUND FOR BIT MIXING
+  hash = __builtin_ia32_aesenc128(hash, hash);
+
+  // USE FIRST 64 BITS AS POSITION HASH
+  return hash[0];
+}
+#elif defined(__aarch64__)
+
+#include <arm_neon.h>
+
+[[nodiscard]] __attribute__((target("+aes"))) u64
+get_hash(const Position *const pos) {
+  uint8x16_t hash = vdupq_n_u8(0);
+
+  // USE 16 BYTE POSITION SEGMENTS AS KEYS FOR AES
+  const u8 *const data = (const u8 *)pos;
+  for (i32 i = 0; i < 5; ++i) {
+    uint8x16_t key;
+    memcpy(&key, data + i * 16, 16);
+
+    hash = vaesmcq_u8(vaeseq_u8(hash, vdupq_n_u8(0)));
+    hash = veorq_u8(hash, key);
+  }
+
+  // FINAL ROUND FOR BIT MIXING
+  uint8x16_t key = hash;
+  hash = vaesmcq_u8(vaeseq_u8(hash, vdupq_n_u8(0)));
+  hash = veorq_u8(hash, key);
+
+  // USE FIRST 64 BITS AS POSITION HASH
+  u64 result;
+  memcpy(&result, &hash, sizeof(result));
+  return result;
+}
+
+#else
+#error "Unsupported architecture: get_hash only for x86_64 and aarch64"
+#endif
+
+#ifdef FULL
+// Moves are handed out in stages, so a cutoff by the TT move or a capture
+// saves generating the quiets at all. Each stage is scored once when it is
+// generated and then picked by selection in score order.
+enum {
+  Stage_TT,
+  Stage_Noisy_Gen,
+  Stage_Noisy,
+  Stage_Killer,
+  Stage_Quiet_Gen,
+  Stage_Quiet,
+  Stage_Done
+};
+
+typedef struct [[nodiscard]] {
+  // Moves before index have been handed out, in order
+  Move *moves;
+  i32 scores[max_moves];
+  i32 index;
+  i32 end;
+  i32 stage;
+  Move tt_move;
+  Move killer;
+  bool only_noisy;
+  MoveMasks masks;
+} MovePicker;
+
+[[nodiscard]] static bool is_noisy(const Move *const move) {
+  return move->takes_piece != None || move->promo != None;
+}
+
+// Drops the moves already handed out by an earlier stage and scores the rest
+static void score_moves(MovePicker *const restrict picker,
+                        const Position *const restrict pos, i32 count) {
+  for (i32 i = picker->end; i < picker->end + count;) {
+    Move *const move = &picker->moves[i];
+    if (move_equal(move, &picker->tt_move) ||
+        move_equal(move, &picker->killer)) {
+      *move = picker->moves[picker->end + --count];
+      continue;
+    }
+    picker->scores[i] =
+        move->takes_piece * 921 +
+        move_history[pos->flipped][move->takes_piece][move->from][move->to];
+    i++;
+  }
+  picker->end += count;
+}
+
+// Index of the next move to search in picker->moves, or -1 when exhausted
+[[nodiscard]] static i32 next_move(MovePicker *const restrict picker,
+                                   const Position *const restrict pos) {
+  switch (picker->stage) {
+  case Stage_TT:
+    picker->stage++;
+    picker->masks = get_masks(pos);
+    if (is_pseudo_legal(pos, &picker->tt_move) &&
+        is_legal(pos, &picker->masks, &picker->tt_move) &&
+        (!picker->only_noisy || is_noisy(&picker->tt_move))) {
+      picker->moves[picker->end++] = picker->tt_move;
+      return picker->index++;
+    }
+    // Invalidate it so the later stages do not drop a generated move equal
+    // to it
+    picker->tt_move = (Move){0};
+    [[fallthrough]];
+  case Stage_Noisy_Gen:
+    picker->stage++;
+    // A killer is always quiet, so it never matches here
+    score_moves(picker, pos,
+                generate_noisy(pos, &picker->masks,
+                               &picker->moves[picker->end]));
+    [[fallthrough]];
+  case Stage_Noisy:
+  case Stage_Quiet:
+    if (picker->index < picker->end) {
+      i32 best = picker->index;
+      for (i32 i = best + 1; i < picker->end; i++) {
+        if (picker->scores[i] > picker->scores[best]) {
+          best = i;
+        }
+      }
+      swapmoves(&picker->moves[picker->index], &picker->moves[best]);
+      picker->scores[best] = picker->scores[picker->index];
+      return picker->index++;
+    }
+    if (picker->stage == Stage_Quiet || picker->only_noisy) {
+      picker->stage = Stage_Done;
+      return -1;
+    }
+    picker->stage++;
+    [[fallthrough]];
+  case Stage_Killer:
+    picker->stage++;
+    if (!is_noisy(&picker->killer) &&
+        !move_equal(&picker->killer, &picker->tt_move) &&
+        is_pseudo_legal(pos, &picker->killer) &&
+        is_legal(pos, &picker->masks, &picker->killer)) {
+      picker->moves[picker->end++] = picker->killer;
+      return picker->index++;
+    }
+    picker->killer = (Move){0};
+    [[fallthrough]];
+  case Stage_Quiet_Gen:
+    picker->stage++;
+    score_moves(picker, pos,
+                generate_quiet(pos, &picker->masks,
+                               &picker->moves[picker->end]));
+    return next_move(picker, pos);
+  default:
+    return -1;
+  }
+}
+#endif
+
+#ifdef HOSTED
+// Syzygy endgame tablebases, memory mapped from the directories listed in
+// SyzygyPath. Tables are split by side to move and, with pawns, by the file of
+// the leading pawn, and store their values compressed by recursive pairing over
+// a canonical Huffman code. Files are parsed when the path is set, so probing
+// only reads shared memory and is safe from every search thread.
+enum { tb_max_pieces = 7, tb_max_tables = 1024, tb_index_size = 4096 };
+enum { tb_win = mate - 2 * max_ply };
+
+// Win, draw or loss from the point of view of the side to move. A cursed win
+// or blessed loss is one the fifty move rule turns into a draw.
+enum { Tb_Loss = -2, Tb_Blessed_Loss, Tb_Draw, Tb_Cursed_Win, Tb_Win };
+
+// Outcome of a probe besides its value
+enum { Tb_Fail, Tb_Ok, Tb_Change_Stm, Tb_Zeroing_Best_Move };
+
+enum {
+  Tb_Stm = 1,
+  Tb_Mapped = 2,
+  Tb_Win_Plies = 4,
+  Tb_Loss_Plies = 8,
+  Tb_Wide = 16,
+  Tb_Single_Value = 128
+};
+
+typedef struct [[nodiscard]] {
+  u8 flags;
+  u8 pieces[tb_max_pieces];
+  u8 group_len[tb_max_pieces + 1];
+  u64 group_idx[tb_max_pieces + 1];
+  u64 block_size;
+  u64 span;
+  u64 sparse_index_size;
+  u64 block_length_size;
+  i32 blocks_num;
+  i32 max_sym_len;
+  i32 min_sym_len; // The value itself for a single value table
+  u16 map_idx[4];
+  const u8 *lowest_sym;
+  const u8 *btree;
+  const u8 *sparse_index;
+  const u8 *block_length;
+  const u8 *data;
+  u64 *base64;
+  u8 *sym_len;
+} TbPairs;
+
+typedef struct [[nodiscard]] {
+  u64 key;
+  u64 key2;
+  i32 piece_count;
+  i32 pawn_count[2]; // Leading side first
+  bool has_pawns;
+  bool has_unique_pieces;
+  // WDL and DTZ files
+  const u8 *file[2];
+  size_t file_size[2];
+  const u8 *map;
+  TbPairs pairs[2][2][4]; // WDL or DTZ, side to move, leading pawn file
+} TbTable;
+
+static TbTable *tb_tables[tb_max_tables];
+static i32 tb_num_tables;
+static TbTable *tb_index[tb_index_size];
+static i32 tb_largest;
+
+static i32 tb_binomial[tb_max_pieces][64];
+static i32 tb_map_pawns[64];
+static i32 tb_lead_pawn_idx[6][64];
+static i32 tb_lead_pawns_size[6][4];
+static i32 tb_map_b1h1h7[64];
+static i32 tb_map_a1d1d4[64];
+static i32 tb_map_kk[10][64];
+
+[[nodiscard]] static i32 tb_off_diagonal(const i32 sq) {
+  return sq / 8 - sq % 8;
+}
+
+static void tb_init_tables() {
+  // Squares below the a1-h8 diagonal
+  i32 code = 0;
+  for (i32 sq = 0; sq < 64; sq++) {
+    if (tb_off_diagonal(sq) < 0) {
+      tb_map_b1h1h7[sq] = code++;
+    }
+  }
+
+  // Squares of the a1-d1-d4 triangle, the diagonal last
+  code = 0;
+  i32 diagonal[4];
+  i32 num_diagonal = 0;
+  for (i32 sq = 0; sq <= 27; sq++) {
+    if (tb_off_diagonal(sq) < 0 && sq % 8 <= 3) {
+      tb_map_a1d1d4[sq] = code++;
+    } else if (!tb_off_diagonal(sq) && sq % 8 <= 3) {
+      diagonal[num_diagonal++] = sq;
+    }
+  }
+  for (i32 i = 0; i < num_diagonal; i++) {
+    tb_map_a1d1d4[diagonal[i]] = code++;
+  }
+
+  // Legal king pairs with the first king in the triangle, both kings on the
+  // diagonal last
+  code = 0;
+  i32 both_diagonal[64][2];
+  i32 num_both = 0;
+  for (i32 idx = 0; idx < 10; idx++) {
+    for (i32 s1 = 0; s1 <= 27; s1++) {
+      if (tb_map_a1d1d4[s1] != idx || (!idx && s1 != 1)) {
+        continue;
+      }
+      for (i32 s2 = 0; s2 < 64; s2++) {
+        const i32 rank_distance = abs(s1 / 8 - s2 / 8);
+        const i32 file_distance = abs(s1 % 8 - s2 % 8);
+        if (rank_distance <= 1 && file_distance <= 1) {
+          continue;
+        }
+        if (!tb_off_diagonal(s1) && tb_off_diagonal(s2) > 0) {
+          continue;
+        }
+        if (!tb_off_diagonal(s1) && !tb_off_diagonal(s2)) {
+          both_diagonal[num_both][0] = idx;
+          both_diagonal[num_both++][1] = s2;
+        } else {
+          tb_map_kk[idx][s2] = code++;
+        }
+      }
+    }
+  }
+  for (i32 i = 0; i < num_both; i++) {
+    tb_map_kk[both_diagonal[i][0]][both_diagonal[i][1]] = code++;
+  }
+
+  tb_binomial[0][0] = 1;
+  for (i32 n = 1; n < 64; n++) {
+    for (i32 k = 0; k < tb_max_pieces && k <= n; k++) {
+      tb_binomial[k][n] = (k > 0 ? tb_binomial[k - 1][n - 1] : 0) +
+                          (k < n ? tb_binomial[k][n - 1] : 0);
+    }
+  }
+
+  // Pawn squares are numbered from the edge files inwards, and the index of
+  // the leading pawns counts the placements on files closer to the edge
+  i32 available = 47;
+  for (i32 lead = 1; lead < 6; lead++) {
+    for (i32 file = 0; file < 4; file++) {
+      i32 idx = 0;
+      for (i32 rank = 1; rank < 7; rank++) {
+        const i32 sq = rank * 8 + file;
+        if (lead == 1) {
+          tb_map_pawns[sq] = available--;
+          tb_map_pawns[sq ^ 7] = available--;
+        }
+        tb_lead_pawn_idx[lead][sq] = idx;
+        idx += tb_binomial[lead - 1][tb_map_pawns[sq]];
+      }
+      tb_lead_pawns_size[lead][file] = idx;
+    }
+  }
+}
+
+[[nodiscard]] static u32 tb_read_le16(const u8 *const data) {
+  return data[0] | data[1] << 8;
+}
+
+[[nodiscard]] static u32 tb_read_le32(const u8 *const data) {
+  return tb_read_le16(data) | tb_read_le16(data + 2) << 16;
+}
+
+[[nodiscard]] static u64 tb_read_be64(const u8 *const data) {
+  u64 value;
+  __builtin_memcpy(&value, data, sizeof value);
+  return __builtin_bswap64(value);
+}
+
+// Piece counts of each colour in 4 bit fields, white in the low half
+[[nodiscard]] static u64 tb_material_key(const u64 colour[2],
+                                         const u64 pieces[7]) {
+  u64 key = 0;
+  for (i32 c = 0; c < 2; c++) {
+    for (i32 p = Pawn; p <= King; p++) {
+      key |= (u64)count(colour[c] & pieces[p]) << (32 * c + 4 * p);
+    }
+  }
+  return key;
+}
+
+[[nodiscard]] static TbTable *tb_find(const u64 key) {
+  for (u32 i = (key ^ key >> 29) % tb_index_size; tb_index[i];
+       i = (i + 1) % tb_index_size) {
+    if (tb_index[i]->key == key || tb_index[i]->key2 == key) {
+      return tb_index[i];
+    }
+  }
+  return NULL;
+}
+
+// Reads the length of a symbol from the tree of pairs, where each symbol is
+// either a byte value or the pair of symbols it stands for
+[[nodiscard]] static i32 tb_set_sym_len(TbPairs *const d, const i32 s,
+                                        bool *const visited) {
+  visited[s] = true;
+  const u8 *const w = d->btree + 3 * s;
+  const i32 right = (w[2] << 4) | (w[1] >> 4);
+  if (right == 0xFFF) {
+    return 0;
+  }
+  const i32 left = ((w[1] & 0xF) << 8) | w[0];
+  if (!visited[left]) {
+    d->sym_len[left] = tb_set_sym_len(d, left, visited);
+  }
+  if (!visited[right]) {
+    d->sym_len[right] = tb_set_sym_len(d, right, visited);
+  }
+  return d->sym_len[left] + d->sym_len[right] + 1;
+}
+
+static const u8 *tb_set_sizes(TbPairs *const d, const u8 *data) {
+  d->flags = *data++;
+  if (d->flags & Tb_Single_Value) {
+    d->blocks_num = 0;
+    d->block_length_size = 0;
+    d->sparse_index_size = 0;
+    d->min_sym_len = *data++;
+    return data;
+  }
+
+  i32 groups = 0;
+  while (d->group_len[groups]) {
+    groups++;
+  }
+  const u64 size = d->group_idx[groups];
+
+  d->block_size = 1ull << *data++;
+  d->span = 1ull << *data++;
+  d->sparse_index_size = (size + d->span - 1) / d->span;
+  const i32 padding = *data++;
+  d->blocks_num = tb_read_le32(data);
+  data += 4;
+  d->block_length_size = d->blocks_num + padding;
+  d->max_sym_len = *data++;
+  d->min_sym_len = *data++;
+  d->lowest_sym = data;
+
+  // First code of each length, left aligned in 64 bits
+  const i32 lengths = d->max_sym_len - d->min_sym_len + 1;
+  d->base64 = calloc(lengths, sizeof(u64));
+  for (i32 i = lengths - 2; i >= 0; i--) {
+    d->base64[i] = (d->base64[i + 1] + tb_read_le16(data + 2 * i) -
+                    tb_read_le16(data + 2 * i + 2)) /
+                   2;
+  }
+  for (i32 i = 0; i < lengths; i++) {
+    d->base64[i] <<= 64 - i - d->min_sym_len;
+  }
+  data += 2 * lengths;
+
+  const i32 symbols = tb_read_le16(data);
+  data += 2;
+  d->btree = data;
+  d->sym_len = calloc(symbols, 1);
+  bool *const visited = calloc(symbols, 1);
+  for (i32 s = 0; s < symbols; s++) {
+    if (!visited[s]) {
+      d->sym_len[s] = tb_set_sym_len(d, s, visited);
+    }
+  }
+  free(visited);
+  return data + 3 * symbols + (symbols & 1);
+}
+
+// Splits the pieces into groups encoded together and sets the number of
+// positions each group multiplies the index by
+static void tb_set_groups(const TbTable *const e, TbPairs *const d,
+                          const i32 order[2], const i32 file) {
+  i32 n = 0;
+  i32 first_len = e->has_pawns ? 0 : e->has_unique_pieces ? 3 : 2;
+  d->group_len[n] = 1;
+  for (i32 i = 1; i < e->piece_count; i++) {
+    if (--first_len > 0 || d->pieces[i] == d->pieces[i - 1]) {
+      d->group_len[n]++;
+    } else {
+      d->group_len[++n] = 1;
+    }
+  }
+  d->group_len[++n] = 0;
+
+  // The leading group is always first, the pawns of the other side (order 1)
+  // and the remaining pieces follow in the order the file gives
+  const bool pawns = e->has_pawns && e->pawn_count[1];
+  i32 next = pawns ? 2 : 1;
+  i32 free_squares = 64 - d->group_len[0] - (pawns ? d->group_len[1] : 0);
+  u64 idx = 1;
+  for (i32 k = 0; next < n || k == order[0] || k == order[1]; k++) {
+    if (k == order[0]) {
+      d->group_idx[0] = idx;
+      idx *= e->has_pawns ? tb_lead_pawns_size[d->group_len[0]][file]
+             : e->has_unique_pieces ? 31332
+                                    : 462;
+    } else if (k == order[1]) {
+      d->group_idx[1] = idx;
+      idx *= tb_binomial[d->group_len[1]][48 - d->group_len[0]];
+    } else {
+      d->group_idx[next] = idx;
+      idx *= tb_binomial[d->group_len[next]][free_squares];
+      free_squares -= d->group_len[next++];
+    }
+  }
+  d->group_idx[n] = idx;
+}
+
+// Parses a table file after its magic, returning false if it does not match
+// the material of its name
+[[nodiscard]] static bool tb_parse(TbTable *const e, const bool dtz) {
+  const u8 *data = e->file[dtz] + 4;
+  const u8 *const end = e->file[dtz] + e->file_size[dtz];
+  const bool split = *data & 1;
+  if (!(*data & 2) != !e->has_pawns ||
+      (!dtz && split != (e->key != e->key2))) {
+    return false;
+  }
+  data++;
+
+  const i32 sides = !dtz && e->key != e->key2 ? 2 : 1;
+  const i32 files = e->has_pawns ? 4 : 1;
+  const bool pawns = e->has_pawns && e->pawn_count[1];
+  for (i32 f = 0; f < files; f++) {
+    const i32 order[2][2] = {{*data & 0xF, pawns ? data[1] & 0xF : 0xF},
+                             {*data >> 4, pawns ? data[1] >> 4 : 0xF}};
+    data += 1 + pawns;
+    for (i32 k = 0; k < e->piece_count; k++, data++) {
+      for (i32 i = 0; i < sides; i++) {
+        e->pairs[dtz][i][f].pieces[k] = i ? *data >> 4 : *data & 0xF;
+      }
+    }
+    for (i32 i = 0; i < sides; i++) {
+      tb_set_groups(e, &e->pairs[dtz][i][f], order[i], f);
+    }
+  }
+  data += (size_t)data & 1;
+
+  for (i32 f = 0; f < files; f++) {
+    for (i32 i = 0; i < sides; i++) {
+      data = tb_set_sizes(&e->pairs[dtz][i][f], data);
+    }
+  }
+
+  if (dtz) {
+    e->map = data;
+    for (i32 f = 0; f < files; f++) {
+      TbPairs *const d = &e->pairs[1][0][f];
+      if (!(d->flags & Tb_Mapped)) {
+        continue;
+      }
+      if (d->flags & Tb_Wide) {
+        data += (size_t)data & 1;
+        for (i32 i = 0; i < 4; i++) {
+          d->map_idx[i] = (data - e->map) / 2 + 1;
+          data += 2 * tb_read_le16(data) + 2;
+        }
+      } else {
+        for (i32 i = 0; i < 4; i++) {
+          d->map_idx[i] = data - e->map + 1;
+          data += *data + 1;
+        }
+      }
+    }
+    data += (size_t)data & 1;
+  }
+
+  for (i32 f = 0; f < files; f++) {
+    for (i32 i = 0; i < sides; i++) {
+      e->pairs[dtz][i][f].sparse_index = data;
+      data += 6 * e->pairs[dtz][i][f].sparse_index_size;
+    }
+  }
+  for (i32 f = 0; f < files; f++) {
+    for (i32 i = 0; i < sides; i++) {
+      e->pairs[dtz][i][f].block_length = data;
+      data += 2 * e->pairs[dtz][i][f].block_length_size;
+    }
+  }
+  for (i32 f = 0; f < files; f++) {
+    for (i32 i = 0; i < sides; i++) {
+      data = (const u8 *)(((size_t)data + 0x3F) & ~(size_t)0x3F);
+      e->pairs[dtz][i][f].data = data;
+      data += e->pairs[dtz][i][f].blocks_num * e->pairs[dtz][i][f].block_size;
+    }
+  }
+  return data <= end;
+}
+
+static void tb_free_pairs(TbTable *const e, const bool dtz) {
+  for (i32 i = 0; i < 2; i++) {
+    for (i32 f = 0; f < 4; f++) {
+      free(e->pairs[dtz][i][f].base64);
+      free(e->pairs[dtz][i][f].sym_len);
+      __builtin_memset(&e->pairs[dtz][i][f], 0, sizeof(TbPairs));
+    }
+  }
+}
+
+// Maps a table file and adds it under the material of its name, such as
+// KRPvKR
+static void tb_add_file(const char *const directory, const char *const name) {
+  const char *const dot = strchr(name, '.');
+  if (!dot || (strcmp(dot, ".rtbw") && strcmp(dot, ".rtbz")) ||
+      dot - name > 16) {
+    return;
+  }
+  const bool dtz = dot[4] == 'z';
+
+  // Material of each side, white left of the 'v'
+  u64 colour[2] = {0};
+  u64 pieces[7] = {0};
+  i32 side = 0;
+  i32 kings = 0;
+  i32 piece_count = 0;
+  for (const char *c = name; c < dot; c++) {
+    if (*c == 'v' && !side) {
+      side = 1;
+      continue;
+    }
+    const char *const found = strchr("PNBRQK", *c);
+    if (!found) {
+      return;
+    }
+    // Material only depends on the counts, so stack the pieces on arbitrary
+    // squares
+    const u64 bb = 1ull << piece_count++;
+    colour[side] |= bb;
+    pieces[found - "PNBRQK" + Pawn] |= bb;
+    kings += *c == 'K';
+  }
+  if (!side || kings != 2 || piece_count > tb_max_pieces) {
+    return;
+  }
+
+  const u64 key = tb_material_key(colour, pieces);
+  TbTable *e = tb_find(key);
+  if (!e) {
+    if (tb_num_tables == tb_max_tables) {
+      return;
+    }
+    e = calloc(1, sizeof(TbTable));
+    e->key = key;
+    const u64 flipped_colour[2] = {colour[1], colour[0]};
+    e->key2 = tb_material_key(flipped_colour, pieces);
+    e->piece_count = piece_count;
+    e->has_pawns = pieces[Pawn];
+    for (i32 c = 0; c < 2; c++) {
+      for (i32 p = Pawn; p < King; p++) {
+        e->has_unique_pieces |= count(colour[c] & pieces[p]) == 1;
+      }
+    }
+    // The leading side is the one with fewer pawns, if it has any
+    const i32 white_pawns = count(colour[0] & pieces[Pawn]);
+    const i32 black_pawns = count(colour[1] & pieces[Pawn]);
+    const bool white_leads =
+        !black_pawns || (white_pawns && black_pawns >= white_pawns);
+    e->pawn_count[0] = white_leads ? white_pawns : black_pawns;
+    e->pawn_count[1] = white_leads ? black_pawns : white_pawns;
+
+    tb_tables[tb_num_tables++] = e;
+    u32 i = (key ^ key >> 29) % tb_index_size;
+    while (tb_index[i]) {
+      i = (i + 1) % tb_index_size;
+    }
+    tb_index[i] = e;
+    if (e->key2 != key) {
+      i = (e->key2 ^ e->key2 >> 29) % tb_index_size;
+      while (tb_index[i]) {
+        i = (i + 1) % tb_index_size;
+      }
+      tb_index[i] = e;
+    }
+  }
+  if (e->file[dtz]) {
+    return;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof path, "%s/%s", directory, name);
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || st.st_size < 16) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  void *const map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  static const u8 magics[2][4] = {{0x71, 0xE8, 0x23, 0x5D},
+                                  {0xD7, 0x66, 0x0C, 0xA5}};
+  e->file[dtz] = map;
+  e->file_size[dtz] = st.st_size;
+  if (memcmp(map, magics[dtz], 4) || !tb_parse(e, dtz)) {
+    printf("info string Tablebase %s is corrupt\n", path);
+    tb_free_pairs(e, dtz);
+    munmap(map, st.st_size);
+    e->file[dtz] = NULL;
+    e->file_size[dtz] = 0;
+    return;
+  }
+  if (!dtz && e->piece_count > tb_largest) {
+    tb_largest = e->piece_count;
+  }
+}
+
+static void tb_free() {
+  for (i32 i = 0; i < tb_num_tables; i++) {
+    for (i32 dtz = 0; dtz < 2; dtz++) {
+      tb_free_pairs(tb_tables[i], dtz);
+      if (tb_tables[i]->file[dtz]) {
+        munmap((void *)tb_tables[i]->file[dtz], tb_tables[i]->file_size[dtz]);
+      }
+    }
+    free(tb_tables[i]);
+  }
+  tb_num_tables = 0;
+  tb_largest = 0;
+  __builtin_memset(tb_index, 0, sizeof tb_index);
+}
+
+// Maps every table in a list of directories separated by colons
+static void tb_init(const char *const paths) {
+  tb_free();
+  if (!tb_binomial[0][0]) {
+    tb_init_tables();
+  }
+
+  i32 wdl_files = 0;
+  i32 dtz_files = 0;
+  const char *start = paths;
+  while (*start) {
+    const char *end = strchr(start, ':');
+    if (!end) {
+      end = start + strlen(start);
+    }
+    char directory[4096];
+    snprintf(directory, sizeof directory, "%.*s", (int)(end - start), start);
+    start = *end ? end + 1 : end;
+
+    DIR *const dir = opendir(directory);
+    if (!dir) {
+      continue;
+    }
+    for (struct dirent *entry; (entry = readdir(dir));) {
+      tb_add_file(directory, entry->d_name);
+    }
+    closedir(dir);
+  }
+  for (i32 i = 0; i < tb_num_tables; i++) {
+    wdl_files += tb_tables[i]->file[0] != NULL;
+    dtz_files += tb_tables[i]->file[1] != NULL;
+  }
+  printf(
+      "info string Found %i WDL and %i DTZ tablebase files up to %i pieces\n",
+      wdl_files, dtz_files, tb_largest);
+}
+
+// Decodes the value at an index of a table: the sparse index finds the block,
+// the Huffman code gives the symbol within it and the tree of pairs expands
+// the symbol to values
+[[nodiscard]] static i32 tb_decompress(const TbPairs *const d, const u64 idx) {
+  if (d->flags & Tb_Single_Value) {
+    return d->min_sym_len;
+  }
+
+  const u64 k = idx / d->span;
+  const u8 *const entry = d->sparse_index + 6 * k;
+  u32 block = tb_read_le32(entry);
+  i64 offset = tb_read_le16(entry + 4) + (i64)(idx % d->span) -
+               (i64)(d->span / 2);
+  while (offset < 0) {
+    offset += tb_read_le16(d->block_length + 2 * --block) + 1;
+  }
+  while (offset > (i64)tb_read_le16(d->block_length + 2 * block)) {
+    offset -= tb_read_le16(d->block_length + 2 * block++) + 1;
+  }
+
+  const u8 *ptr = d->data + block * d->block_size;
+  u64 buf64 = tb_read_be64(ptr);
+  ptr += 8;
+  i32 buf64_size = 64;
+  i32 sym;
+  while (true) {
+    i32 len = 0;
+    while (buf64 < d->base64[len]) {
+      len++;
+    }
+    sym = (buf64 - d->base64[len]) >> (64 - len - d->min_sym_len);
+    sym += tb_read_le16(d->lowest_sym + 2 * len);
+    if (offset < d->sym_len[sym] + 1) {
+      break;
+    }
+    offset -= d->sym_len[sym] + 1;
+    len += d->min_sym_len;
+    buf64 <<= len;
+    buf64_size -= len;
+    if (buf64_size <= 32) {
+      buf64_size += 32;
+      buf64 |= (u64)((u32)ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3])
+               << (64 - buf64_size);
+      ptr += 4;
+    }
+  }
+
+  // Expand the symbol down to a single value
+  while (d->sym_len[sym]) {
+    const u8 *const w = d->btree + 3 * sym;
+    const i32 left = ((w[1] & 0xF) << 8) | w[0];
+    if (offset < d->sym_len[left] + 1) {
+      sym = left;
+    } else {
+      offset -= d->sym_len[left] + 1;
+      sym = (w[2] << 4) | (w[1] >> 4);
+    }
+  }
+  return ((d->btree[3 * sym + 1] & 0xF) << 8) | d->btree[3 * sym];
+}
+
+// Looks up a position in its WDL or DTZ table. The position is encoded as an
+// index over the squares of its pieces, with the board mirrored so the
+// stronger side is white and the leading piece stands in a canonical region.
+[[nodiscard]] static i32 tb_probe_table(const Position *const pos,
+                                        const bool dtz, const i32 wdl,
+                                        i32 *const state) {
+  // Back to real squares and colours
+  Position real = *pos;
+  if (real.flipped) {
+    flip_pos(&real);
+  }
+  if (count(real.colour[0] | real.colour[1]) == 2) {
+    return 0;
+  }
+  const u64 key = tb_material_key(real.colour, real.pieces);
+  const TbTable *const e = tb_find(key);
+  if (!e || !e->file[dtz]) {
+    *state = Tb_Fail;
+    return 0;
+  }
+
+  const bool black_to_move = pos->flipped;
+  const bool flip = key != e->key || (e->key == e->key2 && black_to_move);
+  const i32 flip_colour = flip * 8;
+  const i32 flip_squares = flip * 56;
+  const i32 stm = flip ^ black_to_move;
+
+  i32 squares[tb_max_pieces];
+  i32 codes[tb_max_pieces];
+  i32 size = 0;
+  i32 lead_pawns_count = 0;
+  u64 lead_pawns = 0;
+  i32 file = 0;
+  if (e->has_pawns) {
+    // The leading pawns are those of the colour the table lists first
+    const i32 lead_colour = (e->pairs[dtz][0][0].pieces[0] ^ flip_colour) >> 3;
+    lead_pawns = real.colour[lead_colour] & real.pieces[Pawn];
+    for (u64 bb = lead_pawns; bb; bb &= bb - 1) {
+      squares[size] = lsb(bb) ^ flip_squares;
+      codes[size++] = Pawn | lead_colour << 3;
+    }
+    lead_pawns_count = size;
+    i32 best = 0;
+    for (i32 i = 1; i < size; i++) {
+      if (tb_map_pawns[squares[i]] > tb_map_pawns[squares[best]]) {
+        best = i;
+      }
+    }
+    const i32 swap = squares[0];
+    squares[0] = squares[best];
+    squares[best] = swap;
+    file = squares[0] % 8 < 4 ? squares[0] % 8 : 7 - squares[0] % 8;
+  }
+
+  const TbPairs *const d = &e->pairs[dtz][dtz ? 0 : stm][file];
+  if (dtz && (d->flags & Tb_Stm) != stm &&
+      (e->key != e->key2 || e->has_pawns)) {
+    *state = Tb_Change_Stm;
+    return 0;
+  }
+
+  for (u64 bb = (real.colour[0] | real.colour[1]) & ~lead_pawns; bb;
+       bb &= bb - 1) {
+    const i32 sq = lsb(bb);
+    squares[size] = sq ^ flip_squares;
+    codes[size++] =
+        (piece_on(&real, sq) | (real.colour[1] >> sq & 1) << 3) ^ flip_colour;
+  }
+
+  // Order the pieces the way the table lists them
+  for (i32 i = lead_pawns_count; i < size - 1; i++) {
+    for (i32 j = i + 1; j < size; j++) {
+      if (d->pieces[i] == codes[j]) {
+        i32 swap = squares[i];
+        squares[i] = squares[j];
+        squares[j] = swap;
+        swap = codes[i];
+        codes[i] = codes[j];
+        codes[j] = swap;
+        break;
+      }
+    }
+  }
+
+  // Leading piece on files a to d
+  if (squares[0] % 8 > 3) {
+    for (i32 i = 0; i < size; i++) {
+      squares[i] ^= 7;
+    }
+  }
+
+  u64 idx;
+  if (e->has_pawns) {
+    idx = tb_lead_pawn_idx[lead_pawns_count][squares[0]];
+    for (i32 i = 2; i < lead_pawns_count; i++) {
+      for (i32 j = i; j > 1 && tb_map_pawns[squares[j]] <
+                                   tb_map_pawns[squares[j - 1]];
+           j--) {
+        const i32 swap = squares[j];
+        squares[j] = squares[j - 1];
+        squares[j - 1] = swap;
+      }
+    }
+    for (i32 i = 1; i < lead_pawns_count; i++) {
+      idx += tb_binomial[i][tb_map_pawns[squares[i]]];
+    }
+  } else {
+    // Without pawns the board is also mirrored to ranks 1 to 4 and then to
+    // below the a1-h8 diagonal
+    if (squares[0] / 8 > 3) {
+      for (i32 i = 0; i < size; i++) {
+        squares[i] ^= 56;
+      }
+    }
+    for (i32 i = 0; i < d->group_len[0]; i++) {
+      if (!tb_off_diagonal(squares[i])) {
+        continue;
+      }
+      if (tb_off_diagonal(squares[i]) > 0) {
+        for (i32 j = i; j < size; j++) {
+          squares[j] = ((squares[j] >> 3) | (squares[j] << 3)) & 63;
+        }
+      }
+      break;
+    }
+
+    if (e->has_unique_pieces) {
+      const i32 adjust1 = squares[1] > squares[0];
+      const i32 adjust2 = (squares[2] > squares[0]) + (squares[2] > squares[1]);
+      if (tb_off_diagonal(squares[0])) {
+        idx = (tb_map_a1d1d4[squares[0]] * 63 + (squares[1] - adjust1)) * 62 +
+              squares[2] - adjust2;
+      } else if (tb_off_diagonal(squares[1])) {
+        idx = (6 * 63 + (squares[0] / 8) * 28 + tb_map_b1h1h7[squares[1]]) *
+                  62 +
+              squares[2] - adjust2;
+      } else if (tb_off_diagonal(squares[2])) {
+        idx = 6 * 63 * 62 + 4 * 28 * 62 + (squares[0] / 8) * 7 * 28 +
+              (squares[1] / 8 - adjust1) * 28 + tb_map_b1h1h7[squares[2]];
+      } else {
+        idx = 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 +
+              (squares[0] / 8) * 7 * 6 + (squares[1] / 8 - adjust1) * 6 +
+              squares[2] / 8 - adjust2;
+      }
+    } else {
+      idx = tb_map_kk[tb_map_a1d1d4[squares[0]]][squares[1]];
+    }
+  }
+  idx *= d->group_idx[0];
+
+  // Each further group of like pieces is a combination of the squares left
+  // by the groups before it
+  i32 *group = squares + d->group_len[0];
+  bool remaining_pawns = e->has_pawns && e->pawn_count[1];
+  for (i32 next = 1; d->group_len[next]; next++) {
+    const i32 len = d->group_len[next];
+    for (i32 i = 1; i < len; i++) {
+      for (i32 j = i; j > 0 && group[j] < group[j - 1]; j--) {
+        const i32 swap = group[j];
+        group[j] = group[j - 1];
+        group[j - 1] = swap;
+      }
+    }
+    u64 n = 0;
+    for (i32 i = 0; i < len; i++) {
+      i32 adjust = 0;
+      for (const i32 *sq = squares; sq < group; sq++) {
+        adjust += group[i] > *sq;
+      }
+      n += tb_binomial[i + 1][group[i] - adjust - 8 * remaining_pawns];
+    }
+    remaining_pawns = false;
+    idx += n * d->group_idx[next];
+    group += len;
+  }
+
+  i32 value = tb_decompress(d, idx);
+  if (!dtz) {
+    return value - 2;
+  }
+
+  // DTZ values are stored in moves or plies depending on the outcome, and
+  // possibly through a map to smaller values
+  if (d->flags & Tb_Mapped) {
+    static const i32 wdl_map[5] = {1, 3, 0, 2, 0};
+    const i32 k = d->map_idx[wdl_map[wdl + 2]] + value;
+    value = d->flags & Tb_Wide ? (i32)tb_read_le16(e->map + 2 * k) : e->map[k];
+  }
+  if ((wdl == Tb_Win && !(d->flags & Tb_Win_Plies)) ||
+      (wdl == Tb_Loss && !(d->flags & Tb_Loss_Plies)) ||
+      wdl == Tb_Cursed_Win || wdl == Tb_Blessed_Loss) {
+    value *= 2;
+  }
+  return value + 1;
+}
+
+[[nodiscard]] static bool tb_zeroing(const Position *const pos,
+                                     const Move *const move) {
+  return move->takes_piece != None || pos->pieces[Pawn] >> move->from & 1;
+}
+
+[[nodiscard]] static bool tb_in_check(const Position *const pos) {
+  return is_attacked(pos, lsb(pos->colour[0] & pos->pieces[King]), true);
+}
+
+// WDL of the position, trying captures (and pawn moves when asked) first, as
+// the tables do not store positions where the best move is one of them. A
+// winning zeroing move is reported so DTZ can be counted from it.
+[[nodiscard]] static i32 tb_search(const Position *const pos,
+                                   const bool zeroing_moves, i32 *const state) {
+  Move moves[max_moves];
+  const i32 num_moves = movegen_legal(pos, moves);
+  i32 best = Tb_Loss;
+  i32 moves_searched = 0;
+  for (i32 i = 0; i < num_moves; i++) {
+    const bool en_passant =
+        pos->pieces[Pawn] >> moves[i].from & 1 && 1ull << moves[i].to & pos->ep;
+    if (moves[i].takes_piece == None && !en_passant &&
+        (!zeroing_moves || !tb_zeroing(pos, &moves[i]))) {
+      continue;
+    }
+    moves_searched++;
+    Position npos = *pos;
+    play_move(&npos, &moves[i]);
+    const i32 value = -tb_search(&npos, false, state);
+    if (*state == Tb_Fail) {
+      return 0;
+    }
+    if (value > best) {
+      best = value;
+      if (value >= Tb_Win) {
+        *state = Tb_Zeroing_Best_Move;
+        return value;
+      }
+    }
+  }
+
+  // With every move searched the table is not needed, which also covers
+  // positions where en passant is the only move
+  const bool no_more_moves = moves_searched && moves_searched == num_moves;
+  i32 value = best;
+  if (!no_more_moves) {
+    value = tb_probe_table(pos, false, 0, state);
+    if (*state == Tb_Fail) {
+      return 0;
+    }
+  }
+  if (best >= value) {
+    *state = best > Tb_Draw || no_more_moves ? Tb_Zeroing_Best_Move : Tb_Ok;
+    return best;
+  }
+  *state = Tb_Ok;
+  return value;
+}
+
+[[nodiscard]] static i32 tb_probe_wdl(const Position *const pos,
+                                      i32 *const state) {
+  *state = Tb_Ok;
+  return tb_search(pos, false, state);
+}
+
+// DTZ of the best zeroing move, given its WDL
+[[nodiscard]] static i32 tb_dtz_before_zeroing(const i32 wdl) {
+  return wdl == Tb_Win           ? 1
+         : wdl == Tb_Cursed_Win  ? 101
+         : wdl == Tb_Blessed_Loss ? -101
+         : wdl == Tb_Loss        ? -1
+                                 : 0;
+}
+
+[[nodiscard]] static i32 tb_sign(const i32 value) {
+  return (value > 0) - (value < 0);
+}
+
+// Plies to the next zeroing move with best play, positive when winning. Off
+// by one in either direction around the fifty move boundary, as the tables
+// themselves are.
+[[nodiscard]] static i32 tb_probe_dtz(const Position *const pos,
+                                      i32 *const state) {
+  *state = Tb_Ok;
+  const i32 wdl = tb_search(pos, true, state);
+  if (*state == Tb_Fail || wdl == Tb_Draw) {
+    return 0;
+  }
+  if (*state == Tb_Zeroing_Best_Move) {
+    return tb_dtz_before_zeroing(wdl);
+  }
+
+  const i32 dtz = tb_probe_table(pos, true, wdl, state);
+  if (*state == Tb_Fail) {
+    return 0;
+  }
+  if (*state != Tb_Change_Stm) {
+    return (dtz + 100 * (wdl == Tb_Blessed_Loss || wdl == Tb_Cursed_Win)) *
+           tb_sign(wdl);
+  }
+
+  // The table only stores the other side to move, so search one ply
+  i32 min_dtz = 0xFFFF;
+  Move moves[max_moves];
+  const i32 num_moves = movegen_legal(pos, moves);
+  for (i32 i = 0; i < num_moves; i++) {
+    const bool zeroing = tb_zeroing(pos, &moves[i]);
+    Position npos = *pos;
+    play_move(&npos, &moves[i]);
+    i32 move_dtz =
+        zeroing ? -tb_dtz_before_zeroing(tb_search(&npos, false, state))
+                : -tb_probe_dtz(&npos, state);
+    // Checkmate the opponent at once
+    if (move_dtz == 1 && tb_in_check(&npos)) {
+      Move replies[max_moves];
+      if (!movegen_legal(&npos, replies)) {
+        min_dtz = 1;
+      }
+    }
+    if (!zeroing) {
+      move_dtz += tb_sign(move_dtz);
+    }
+    if (move_dtz < min_dtz && tb_sign(move_dtz) == tb_sign(wdl)) {
+      min_dtz = move_dtz;
+    }
+    if (*state == Tb_Fail) {
+      return 0;
+    }
+  }
+  return min_dtz == 0xFFFF ? -1 : min_dtz;
+}
+
+[[nodiscard]] static bool tb_probeable(const Position *const pos) {
+  return tb_largest && count(pos->colour[0] | pos->colour[1]) <= tb_largest &&
+         !(pos->castling[0] | pos->castling[1] | pos->castling[2] |
+           pos->castling[3]);
+}
+
+// Root moves with the best tablebase outcome, by from and to square, and the
+// key of the position they are for. Searches that are not played at once only
+// look at these at the root.
+static u64 tb_root_moves[64];
+static u64 tb_root_key;
+
+// Win, cursed win, draw, blessed loss or loss, as a root move's DTZ tells.
+// The plies already played since the last zeroing move count towards the
+// fifty move rule, so a win that needs more than 100 in all is only a draw.
+[[nodiscard]] static i32 tb_outcome(const i32 dtz, const i32 halfmove) {
+  return dtz > 0   ? dtz + halfmove > 100 ? Tb_Cursed_Win : Tb_Win
+         : dtz < 0 ? halfmove - dtz > 100 ? Tb_Blessed_Loss : Tb_Loss
+                   : Tb_Draw;
+}
+
+// Picks the root move by DTZ: the fastest zeroing move that keeps a win, any
+// move that holds a draw, or the longest resistance when lost. Every move
+// with the same outcome is kept in tb_root_moves.
+[[nodiscard]] static bool tb_probe_root(const Position *const pos,
+                                        Move *const move) {
+  if (!tb_probeable(pos)) {
+    return false;
+  }
+  Move moves[max_moves];
+  i32 outcomes[max_moves];
+  const i32 num_moves = movegen_legal(pos, moves);
+  i32 best_rank = -inf;
+  i32 best_outcome = Tb_Loss;
+  for (i32 i = 0; i < num_moves; i++) {
+    Position npos = *pos;
+    play_move(&npos, &moves[i]);
+    i32 state;
+    i32 dtz;
+    if (tb_zeroing(pos, &moves[i])) {
+      dtz = tb_dtz_before_zeroing(-tb_probe_wdl(&npos, &state));
+    } else {
+      dtz = -tb_probe_dtz(&npos, &state);
+      dtz += tb_sign(dtz);
+    }
+    if (state == Tb_Fail) {
+      return false;
+    }
+    if (tb_in_check(&npos)) {
+      Move replies[max_moves];
+      if (!movegen_legal(&npos, replies)) {
+        dtz = 1;
+      }
+    }
+    const i32 rank = dtz > 0 ? 1000 - dtz : dtz < 0 ? -1000 - dtz : 0;
+    outcomes[i] = tb_outcome(dtz, pos->halfmove);
+    if (rank > best_rank) {
+      best_rank = rank;
+      best_outcome = outcomes[i];
+      *move = moves[i];
+    }
+  }
+
+  __builtin_memset(tb_root_moves, 0, sizeof tb_root_moves);
+  for (i32 i = 0; i < num_moves; i++) {
+    if (outcomes[i] == best_outcome) {
+      tb_root_moves[moves[i].from] |= 1ull << moves[i].to;
+    }
+  }
+  tb_root_key = pos->key;
+  return num_moves;
+}
+#endif
+
+#ifdef STATS
+#ifndef FULL
+#error "STATS needs a FULL build"
+#endif
+// Search counters for comparing builds, kept by each thread. Compiled out
+// entirely unless STATS is defined.
+typedef struct [[nodiscard]] {
+  u64 main_nodes;
+  u64 qsearch_nodes;
+  u64 tt_probes;
+  u64 tt_hits;
+  u64 tt_cutoffs;
+  u64 fail_highs;
+  u64 fail_highs_first;
+  u64 null_tries;
+  u64 null_cutoffs;
+  u64 rfp_tries;
+  u64 rfp_cutoffs;
+  u64 razor_tries;
+  u64 razor_fail_lows;
+  u64 reduced_searches;
+  u64 reduced_researches;
+  u64 late_move_prunes;
+  u64 iteration_nodes_start;
+  u64 iteration_nodes;
+  u64 previous_iteration_nodes;
+} SearchStats;
+
+static per_thread SearchStats stats;
+
+// Counters of every search thread at the end of the last search
+static SearchStats last_stats;
+
+#ifdef HOSTED
+// Counters each helper leaves behind when its search ends
+static SearchStats helper_stats[max_threads];
+#endif
+
+#define stats_add(counter, amount) (stats.counter += (amount))
+
+[[nodiscard]] static u64 percent(const u64 part, const u64 whole) {
+  return whole ? 100 * part / whole : 0;
+}
+
+// Every counter is a u64, so the counters add up field by field
+static void add_stats(SearchStats *const total,
+                      const SearchStats *const counters) {
+  u64 *const to = (u64 *)total;
+  const u64 *const from = (const u64 *)counters;
+  for (size_t i = 0; i < sizeof(SearchStats) / sizeof(u64); i++) {
+    to[i] += from[i];
+  }
+}
+
+// Rates are in percent, the effective branching factor is that of the last
+// iteration over the one before it. Searched nodes include null move children.
+// The scope says whose counters these are: the main thread's while it
+// searches, all threads' once the search is over.
+static void print_stats(const SearchStats counters, const char *const scope) {
+  const u64 ebf =
+      counters.previous_iteration_nodes
+          ? 10 * counters.iteration_nodes / counters.previous_iteration_nodes
+          : 0;
+  putl("info string stats ");
+  putl(scope);
+  printf(" searched %i qnodes %i tt probes %i hits %i cutoffs %i fhf %i",
+         counters.main_nodes + counters.qsearch_nodes,
+         percent(counters.qsearch_nodes,
+                 counters.main_nodes + counters.qsearch_nodes),
+         counters.tt_probes, percent(counters.tt_hits, counters.tt_probes),
+         percent(counters.tt_cutoffs, counters.tt_probes),
+         percent(counters.fail_highs_first, counters.fail_highs));
+  printf(" nmp %i rfp %i razor %i lmr research %i lmp %i ebf %i.%i\n",
+         percent(counters.null_cutoffs, counters.null_tries),
+         percent(counters.rfp_cutoffs, counters.rfp_tries),
+         percent(counters.razor_fail_lows, counters.razor_tries),
+         percent(counters.reduced_researches, counters.reduced_searches),
+         counters.late_move_prunes, ebf / 10, ebf % 10);
+}
+#else
+#define stats_add(counter, amount) ((void)0)
+#endif
+#define stats_inc(counter) stats_add(counter, 1)
+
+static i16 search(Position *const restrict pos, const i32 ply, i32 depth,
+                  i32 alpha, const i32 beta,
+#ifdef FULL
+                  u64 *nodes,
+#endif
+                  SearchStack *restrict stack, const i32 pos_history_count,
+                  const bool do_null) {
+  assert(alpha < beta);
+  assert(ply >= 0);
+
+#ifdef FULL
+  // NNUE ACCUMULATOR OF THE ROOT
+  if (!ply) {
+    pos->accumulator = NULL;
+    if (use_nnue) {
+      nnue_refresh(pos, nnue_stack);
+      pos->accumulator = nnue_stack;
+    }
+  }
+#endif
+
+  const bool in_check =
+      is_attacked(pos, lsb(pos->colour[0] & pos->pieces[King]), true);
+
+  // IN-CHECK EXTENSION
+  if (in_check) {
+    depth++;
+  }
+
+  // EARLY EXITS
+#ifdef FULL
+  if (*nodes >= next_poll) {
+    next_poll = *nodes + poll_interval;
+    check_limits(*nodes);
+  }
+  if (stop || *nodes >= node_cap) {
+    return alpha;
+  }
+#else
+  if (depth > 4 && get_time() - start_time > max_time) {
+    return alpha;
+  }
+#endif
+
+#ifdef FULL
+  const u64 tt_hash = pos->key;
+#else
+  const u64 tt_hash = get_hash(pos);
+#endif
 
-  const u64 tt_hash = get_hash(pos);
-
   // FULL REPETITION DETECTION
   bool in_qsearch = depth <= 0;
+  stats_add(qsearch_nodes, in_qsearch);
+  stats_add(main_nodes, !in_qsearch);
+#ifdef FULL
+  // ONLY BACK TO THE LAST CAPTURE OR PAWN MOVE, SAME SIDE TO MOVE
+  const i32 history_index = pos_history_count + ply;
+  key_history[history_index] = tt_hash;
+  if (ply && !in_qsearch) {
+    const i32 oldest = history_index - pos->halfmove;
+    for (i32 i = history_index - 4; i >= 0 && i >= oldest; i -= 2) {
+      if (tt_hash == key_history[i]) {
+        return 0;
+      }
+    }
+  }
+
+  // FIFTY-MOVE RULE, UNLESS IT MIGHT BE MATE
+  if (ply && pos->halfmove >= 100 && !in_check) {
+    return 0;
+  }
+#else
   for (i32 i = pos_history_count + ply; !in_qsearch && i > 0 && ply > 0;
        i -= 2) {
     if (tt_hash == stack[i].position_hash) {
       return 0;
     }
   }
+#endif
+
+  // TT PROBING
+#ifdef FULL
+  TTBucket *const bucket = tt_bucket(tt_hash);
+  const u16 tt_hash_partial = tt_hash;
+  TTEntry tt_snapshot = tt_load(bucket, tt_hash_partial);
+  TTEntry *tt_entry = &tt_snapshot;
+#else
+  TTEntry *tt_entry = &tt[tt_hash % tt_length];
+  const u16 tt_hash_partial = tt_hash / tt_length;
+#endif
+  Move tt_move = {0};
+  stats_inc(tt_probes);
+  if (tt_entry->partial_hash == tt_hash_partial) {
+    tt_move = tt_entry->move;
+    stats_inc(tt_hits);
+
+    // TT PRUNING
+    if (alpha == beta - 1 && tt_entry->depth >= depth &&
+        tt_entry->flag != tt_entry->score <= alpha) {
+      stats_inc(tt_cutoffs);
+      return tt_entry->score;
+    }
+  } else {
+    // INTERNAL ITERATIVE REDUCTION
+    depth -= depth > 3;
+  }
+
+#ifdef HOSTED
+  // TABLEBASE PROBING AFTER CAPTURES AND PAWN MOVES
+  // Bounds that do not cut off in a PV node still bound its score
+  i32 tb_min_score = -inf;
+  i32 tb_max_score = inf;
+  if (ply && !in_qsearch && stack[ply].zeroing && tb_probeable(pos)) {
+    i32 state;
+    const i32 wdl = tb_probe_wdl(pos, &state);
+    if (state != Tb_Fail) {
+      const i32 score = wdl < Tb_Blessed_Loss ? ply - tb_win
+                        : wdl > Tb_Cursed_Win ? tb_win - ply
+                                              : 0;
+      const u8 flag = wdl < Tb_Blessed_Loss ? Upper
+                      : wdl > Tb_Cursed_Win ? Lower
+                                            : Exact;
+      if (flag == Exact || (flag == Lower ? score >= beta : score <= alpha)) {
+        tt_save(bucket,
+                (TTEntry){.partial_hash = tt_hash_partial,
+                          .move = {0},
+                          .score = score,
+                          .depth = depth + 6 < max_ply ? depth + 6 : max_ply,
+                          .flag = flag});
+        return score;
+      }
+      if (flag == Lower) {
+        tb_min_score = score;
+      } else {
+        tb_max_score = score;
+      }
+    }
+  }
+#endif
+
+  // STATIC EVAL WITH ADJUSTMENT FROM TT
+#ifdef FULL
+  i32 static_eval = use_nnue ? nnue_eval(pos) : eval_incremental(pos);
+#else
+  i32 static_eval = eval(pos);
+#endif
+  if (tt_entry->flag != static_eval > tt_entry->score &&
+      tt_entry->partial_hash == tt_hash_partial) {
+    static_eval = tt_entry->score;
+  }
+
+  // QUIESCENCE
+  if (in_qsearch && static_eval > alpha) {
+    if (static_eval >= beta) {
+      return static_eval;
+    }
+    alpha = static_eval;
+  }
+
+  if (!in_qsearch && depth < 8 && alpha == beta - 1 && !in_check) {
+    // REVERSE FUTILITY PRUNING
+    stats_inc(rfp_tries);
+    if (static_eval - 47 * depth >= beta) {
+      stats_inc(rfp_cutoffs);
+      return static_eval;
+    }
+
+    // RAZORING
+    in_qsearch = static_eval + 131 * depth <= alpha;
+    stats_add(razor_tries, in_qsearch);
+  }
+
+  // NULL MOVE PRUNING
+  if (depth > 2 && do_null && static_eval >= beta && alpha == beta - 1 &&
+      !in_check) {
+    stats_inc(null_tries);
+    Position npos = *pos;
+    flip_pos(&npos);
+#ifdef FULL
+    npos.key ^= zobrist_side ^ ep_key(npos.ep);
+    npos.halfmove = 0; // No repetition reaches across a null move
+#endif
+    npos.ep = 0;
+#ifdef HOSTED
+    stack[ply + 1].zeroing = false;
+#endif
+    if (-search(&npos, ply + 1, depth - 4, -beta, -alpha,
+#ifdef FULL
+                nodes,
+#endif
+                stack, pos_history_count, false) >= beta) {
+      stats_inc(null_cutoffs);
+      return beta;
+    }
+  }
+
+#ifdef FULL
+  MovePicker picker = {.moves = stack[ply].moves,
+                       .tt_move = tt_move,
+                       .killer = stack[ply].killer,
+                       .only_noisy = in_qsearch};
+#else
+  stack[ply].num_moves = movegen(pos, stack[ply].moves, in_qsearch);
+#endif
+  stack[ply].best_move = tt_move;
+#ifndef FULL
+  stack[pos_history_count + ply + 2].position_hash = tt_hash;
+#endif
+  i32 moves_evaluated = 0;
+  i32 quiets_evaluated = 0;
+  u8 tt_flag = Upper;
+  i32 best_score = in_qsearch ? static_eval : -inf;
+
+#ifdef FULL
+  for (i32 move_index; (move_index = next_move(&picker, pos)) >= 0;) {
+#else
+  for (i32 move_index = 0; move_index < stack[ply].num_moves; move_index++) {
+    i32 move_score = ~0x1010101LL; // Ends up as large negative
+
+    // MOVE ORDERING
+    for (i32 order_index = move_index; order_index < stack[ply].num_moves;
+         order_index++) {
+      assert(stack[ply].moves[order_index].takes_piece ==
+             piece_on(pos, stack[ply].moves[order_index].to));
+      const i32 order_move_score =
+          ((i32)move_equal(&tt_move, &stack[ply].moves[order_index])
+           << 30) // PREVIOUS BEST MOVE FIRST
+          + (i32)stack[ply].moves[order_index].takes_piece * 921 +
+          (i32)move_equal(&stack[ply].killer, &stack[ply].moves[order_index]) *
+              915 // KILLER MOVE
+          +
+          move_history[pos->flipped][stack[ply].moves[order_index].takes_piece]
+                      [stack[ply].moves[order_index].from]
+                      [stack[ply].moves[order_index].to]; // HISTORY HEURISTIC
+      if (order_move_score > move_score) {
+        move_score = order_move_score;
+        swapmoves(&stack[ply].moves[move_index],
+                  &stack[ply].moves[order_index]);
+      }
+    }
+#endif
+
+#ifdef HOSTED
+    // ROOT MOVES THAT GIVE UP THE TABLEBASE OUTCOME ARE NOT SEARCHED
+    if (!ply && pos->key == tb_root_key &&
+        !(tb_root_moves[stack[0].moves[move_index].from] &
+          1ull << stack[0].moves[move_index].to)) {
+      continue;
+    }
+#endif
+
+    Position npos = *pos;
+#ifdef FULL
+    const u64 nodes_before = *nodes;
+    // Only this thread writes its count, but others read it while it runs
+    __atomic_store_n(nodes, nodes_before + 1, __ATOMIC_RELAXED);
+    __builtin_prefetch(
+        tt_bucket(key_after(pos, &stack[ply].moves[move_index])));
+#ifdef HOSTED
+    stack[ply + 1].zeroing = tb_zeroing(pos, &stack[ply].moves[move_index]);
+#endif
+    play_move(&npos, &stack[ply].moves[move_index]);
+#else
+    if (!makemove(&npos, &stack[ply].moves[move_index])) {
+      continue;
+    }
+#endif
+
+    // PRINCIPAL VARIATION SEARCH
+    i32 low = moves_evaluated == 0 ? -beta : -alpha - 1;
+    moves_evaluated++;
+
+    // LATE MOVE REDCUCTION
+    i32 reduction =
+        depth > 1 && moves_evaluated > 6 ? 2 + moves_evaluated / 13 : 1;
+    stats_add(reduced_searches, reduction > 1);
+
+    i32 score;
+    while (true) {
+      score = -search(&npos, ply + 1, depth - reduction, low, -alpha,
+#ifdef FULL
+                      nodes,
+#endif
+                      stack, pos_history_count, true);
+
+      if (score <= alpha || (low == -beta && reduction == 1)) {
+        break;
+      }
+
+      stats_add(reduced_researches, reduction > 1);
+      low = -beta;
+      reduction = 1;
+    }
+
+#ifdef FULL
+    if (!ply) {
+      root_move_nodes[stack[0].moves[move_index].from]
+                     [stack[0].moves[move_index].to] += *nodes - nodes_before;
+    }
+
+    // AN ABORTED SEARCH UPDATES NEITHER THE BEST MOVE NOR THE TT
+    if (stop || *nodes >= node_cap) {
+      return alpha;
+    }
+#endif
+
+    if (score > best_score) {
+      best_score = score;
+    }
+
+    if (score > alpha) {
+      stack[ply].best_move = stack[ply].moves[move_index];
+      alpha = score;
+      tt_flag = Exact;
+      if (score >= beta) {
+        tt_flag = Lower;
+        stats_inc(fail_highs);
+        stats_add(fail_highs_first, moves_evaluated == 1);
+        assert(stack[ply].best_move.takes_piece ==
+               piece_on(pos, stack[ply].best_move.to));
+        i32 *const this_hist =
+            &move_history[pos->flipped][stack[ply].best_move.takes_piece]
+                         [stack[ply].best_move.from][stack[ply].best_move.to];
+        *this_hist += depth * depth - depth * depth * *this_hist / 1024;
+        for (i32 prev_index = 0; prev_index < move_index; prev_index++) {
+          const Move prev = stack[ply].moves[prev_index];
+          i32 *const prev_hist =
+              &move_history[pos->flipped][prev.takes_piece][prev.from][prev.to];
+          *prev_hist -= depth * depth + depth * depth * *prev_hist / 1024;
+        }
+        if (stack[ply].best_move.takes_piece == None) {
+          stack[ply].killer = stack[ply].best_move;
+        }
+        break;
+      }
+    }
+
+    if (stack[ply].moves[move_index].takes_piece == None) {
+      quiets_evaluated++;
+    }
+
+    // LATE MOVE PRUNING
+    if (!in_check && alpha == beta - 1 &&
+        quiets_evaluated > 1 + depth * depth) {
+      stats_inc(late_move_prunes);
+      break;
+    }
+  }
+
+  // Razored nodes are the ones searched as quiescence at positive depth
+  stats_add(razor_fail_lows, in_qsearch && depth > 0 && tt_flag == Upper);
+
+  // MATE / STALEMATE DETECTION
+  if (best_score == -inf) {
+    return (ply - mate) * in_check;
+  }
+#ifdef FULL
+  // Quiescence only tries captures, so a check it found no answer to is mate
+  // unless a quiet move escapes
+  if (in_qsearch && in_check && !moves_evaluated &&
+      !generate_quiet(pos, &picker.masks, &stack[ply].moves[picker.end])) {
+    return ply - mate;
+  }
+#endif
+#ifdef HOSTED
+  best_score = best_score < tb_min_score   ? tb_min_score
+               : best_score > tb_max_score ? tb_max_score
+                                           : best_score;
+#endif
+
+#ifdef FULL
+  tt_save(bucket, (TTEntry){.partial_hash = tt_hash_partial,
+                            .move = stack[ply].best_move,
+                            .score = best_score,
+                            .depth = depth,
+                            .flag = tt_flag});
+#else
+  *tt_entry = (TTEntry){.partial_hash = tt_hash_partial,
+                        .move = stack[ply].best_move,
+                        .score = best_score,
+                        .depth = depth,
+                        .flag = tt_flag};
+#endif
+
+  return best_score;
+}
+
+#ifdef FULL
+// Reply expected by the engine after its best move, taken from the TT
+[[nodiscard]] static bool get_ponder_move(const Position *const pos,
+                                          Move *const best_move,
+                                          Move *const ponder_move) {
+  Position npos = *pos;
+  if (best_move->from == best_move->to || !makemove(&npos, best_move)) {
+    return false;
+  }
+  TTEntry entry = tt_load(tt_bucket(npos.key), npos.key);
+  if (entry.partial_hash != (u16)npos.key) {
+    return false;
+  }
+  Move moves[max_moves];
+  const i32 num_moves = movegen(&npos, moves, false);
+  for (i32 i = 0; i < num_moves; i++) {
+    Position child = npos;
+    if (move_equal(&moves[i], &entry.move) && makemove(&child, &moves[i])) {
+      *ponder_move = moves[i];
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+#ifdef HOSTED
+// LAZY SMP HELPER, SHARING ONLY THE TRANSPOSITION TABLE WITH THE MAIN THREAD
+static void *helper_search(void *const arg) {
+  SearchThread *const thread = arg;
+  __builtin_memset(move_history, 0, sizeof(move_history));
+  __builtin_memcpy(key_history, thread->keys,
+                   sizeof(u64) * thread->pos_history_count);
+  next_poll = -1;
+
+  // Odd helpers start one iteration ahead to diversify the shared tree
+  for (i32 depth = 1 + (thread - threads) % 2; depth < thread->maxdepth;
+       depth++) {
+    search(&thread->pos, 0, depth, -inf, inf, &thread->nodes, thread->stack,
+           thread->pos_history_count, false);
+    if (stop) {
+      break;
+    }
+    thread->depth = depth;
+    thread->best_move = thread->stack[0].best_move;
+  }
+#ifdef STATS
+  helper_stats[thread - threads] = stats;
+#endif
+  return NULL;
+}
+
+static void start_helpers(const Position *const pos,
+                          const SearchStack *const stack,
+                          const i32 pos_history_count, const i32 maxdepth) {
+  for (i32 i = 1; i < num_threads; i++) {
+    SearchThread *const thread = &threads[i];
+    if (!thread->stack) {
+      thread->stack = malloc(sizeof(SearchStack) * 1024);
+    }
+    thread->pos = *pos;
+    thread->keys = key_history;
+    thread->pos_history_count = pos_history_count;
+    thread->maxdepth = maxdepth;
+    thread->nodes = 0;
+    thread->depth = 0;
+    pthread_create(&thread->handle, NULL, helper_search, thread);
+  }
+}
+
+// Stops the helpers and returns the best move of the deepest completed
+// iteration, preferring the main thread on equal depth
+[[nodiscard]] static Move stop_helpers(u64 *const nodes, Move best_move,
+                                       i32 best_depth) {
+  stop = true;
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_join(threads[i].handle, NULL);
+    *nodes += threads[i].nodes;
+    if (threads[i].depth > best_depth) {
+      best_depth = threads[i].depth;
+      best_move = threads[i].best_move;
+    }
+  }
+  return best_move;
+}
+#endif
+
+static void iteratively_deepen(
+#ifdef FULL
+    i32 maxdepth, u64 *nodes,
+#endif
+    Position *const restrict pos, SearchStack *restrict stack,
+    const i32 pos_history_count) {
+  start_time = get_time();
+  __builtin_memset(move_history, 0, sizeof(move_history));
+#ifdef FULL
+  tt_age = tt_age % age_mask + 1;
+  next_poll = 0;
+#endif
+#ifdef STATS
+  stats = (SearchStats){0};
+#endif
+#ifdef HOSTED
+  start_helpers(pos, stack, pos_history_count, maxdepth);
+  i32 completed = 0;
+#endif
+#ifdef FULL
+  __builtin_memset(root_move_nodes, 0, sizeof(root_move_nodes));
+  i32 score = 0;
+  i32 stability = 0;
+  Move previous_best = {0};
+  for (i32 depth = 1; depth < maxdepth; depth++) {
+    // ASPIRATION WINDOWS AROUND THE LAST SCORE, WIDENED ON EACH FAILURE
+    const i32 previous_score = score;
+    i32 window = aspiration_window;
+    i32 alpha = depth > 4 ? score - window : -inf;
+    i32 beta = depth > 4 ? score + window : inf;
+    while (true) {
+      score = search(pos, 0, depth, alpha, beta, nodes, stack,
+                     pos_history_count, false);
+      if (stop || (score > alpha && score < beta)) {
+        break;
+      }
+      window *= 2;
+      if (score <= alpha) {
+        beta = (alpha + beta) / 2;
+        alpha = score - window > -inf ? score - window : -inf;
+      } else {
+        beta = score + window < inf ? score + window : inf;
+      }
+    }
+#else
+  for (i32 depth = 1; depth < max_ply; depth++) {
+    i32 score = search(pos, 0, depth, -inf, inf, stack, pos_history_count,
+                       false);
+#endif
+    size_t elapsed = get_time() - start_time;
+
+#ifdef FULL
+    if (stop) {
+      break;
+    }
+#endif
+#ifdef HOSTED
+    completed = depth;
+#endif
+
+#ifdef FULL
+    if (!quiet) {
+      u64 all_nodes = *nodes;
+#ifdef HOSTED
+      all_nodes += helper_nodes();
+#endif
+      printf("info depth %i score cp %i time %i nodes %i", depth, score,
+             elapsed, all_nodes);
+      if (elapsed > 0) {
+        const u64 nps = all_nodes * 1000 / elapsed;
+        printf(" nps %i", nps);
+      }
+      printf(" hashfull %i", hashfull());
+
+      putl(" pv ");
+      char move_name[8];
+      move_str(move_name, &stack[0].best_move, pos->flipped);
+      putl(move_name);
+      putl("\n");
+    }
+#endif
+#ifdef STATS
+    const u64 searched = stats.main_nodes + stats.qsearch_nodes;
+    stats.previous_iteration_nodes = stats.iteration_nodes;
+    stats.iteration_nodes = searched - stats.iteration_nodes_start;
+    stats.iteration_nodes_start = searched;
+    if (!quiet) {
+      print_stats(stats, "main");
+    }
+#endif
+
+#ifdef FULL
+    if (limits.mate && score >= mate - 2 * limits.mate) {
+      break;
+    }
+
+    // SOFT LIMIT SCALED BY BEST MOVE STABILITY, SCORE DROPS AND THE SHARE OF
+    // NODES THE BEST MOVE TOOK
+    Move best = stack[0].best_move;
+    stability = move_equal(&best, &previous_best)
+                    ? stability + (stability < 6)
+                    : 0;
+    previous_best = best;
+    size_t soft = limits.soft;
+    if (soft != no_limits.soft && *nodes) {
+      const i32 drop = previous_score - score < 0    ? 0
+                       : previous_score - score > 50 ? 50
+                                                     : previous_score - score;
+      // A mate found is as good as a move that took every node
+      i32 best_share = score > mate - max_ply
+                           ? 100
+                           : root_move_nodes[best.from][best.to] * 100 / *nodes;
+      best_share = best_share < 25 ? 25 : best_share;
+      soft = soft * (180 - 15 * stability) / 100 * (100 + 2 * drop) / 100 *
+             (250 - 2 * best_share) / 100;
+      soft = soft < limits.hard ? soft : limits.hard;
+    }
+#endif
+#ifdef HOSTED
+    if (!pondering && !infinite && elapsed > soft) {
+#elif defined(FULL)
+    if (elapsed > soft) {
+#else
+    if (elapsed > max_time / 16) {
+#endif
+      break;
+    }
+  }
+  char move_name[8];
+#ifdef STATS
+  last_stats = stats;
+#endif
+#ifdef FULL
+#ifdef HOSTED
+  // An infinite or ponder search only answers once told to stop
+  while ((infinite || pondering) && !stop) {
+    usleep(1000);
+  }
+  infinite = pondering = false;
+  Move best_move = stop_helpers(nodes, stack[0].best_move, completed);
+#ifdef STATS
+  for (i32 i = 1; i < num_threads; i++) {
+    add_stats(&last_stats, &helper_stats[i]);
+  }
+#endif
+#else
+  Move best_move = stack[0].best_move;
+#endif
+  if (quiet) {
+    return;
+  }
+#ifdef STATS
+  // How the time limits held up, next to the other search diagnostics
+  if (limits.hard != no_limits.hard) {
+    const size_t used = get_time() - start_time;
+    printf("info string time soft %i hard %i used %i overshoot %i\n",
+           limits.soft, limits.hard, used,
+           used > limits.hard ? used - limits.hard : 0);
+  }
+#endif
+  move_str(move_name, &best_move, pos->flipped);
+  putl("bestmove ");
+  putl(move_name);
+  Move ponder_move;
+  if (get_ponder_move(pos, &best_move, &ponder_move)) {
+    move_str(move_name, &ponder_move, !pos->flipped);
+    putl(" ponder ");
+    putl(move_name);
+  }
+#else
+  move_str(move_name, &stack[0].best_move, pos->flipped);
+  putl("bestmove ");
+  putl(move_name);
+#endif
+  putl("\n");
+}
+
+#ifdef HOSTED
+// The UCI thread keeps reading input while this thread searches
+static bool searching;
+
+static void *uci_search(void *const arg) {
+  SearchThread *const thread = arg;
+  __builtin_memcpy(key_history, thread->keys,
+                   sizeof(u64) * thread->pos_history_count);
+  iteratively_deepen(thread->maxdepth, &thread->nodes, &thread->pos,
+                     thread->stack, thread->pos_history_count);
+  return NULL;
+}
+
+static void start_search(const Position *const pos, SearchStack *const stack,
+                         const i32 pos_history_count, const i32 maxdepth) {
+  SearchThread *const thread = &threads[0];
+  thread->maxdepth = maxdepth;
+  thread->pos = *pos;
+  thread->stack = stack;
+  thread->keys = key_history;
+  thread->pos_history_count = pos_history_count;
+  thread->nodes = 0;
+  stop = false;
+  searching = true;
+  pthread_create(&thread->handle, NULL, uci_search, thread);
+}
+
+static void wait_for_search() {
+  if (searching) {
+    pthread_join(threads[0].handle, NULL);
+    searching = false;
+  }
+}
+#endif
+
+static void display_pos(Position *const pos) {
+  Position npos = *pos;
+  if (npos.flipped) {
+    flip_pos(&npos);
+  }
+  for (i32 rank = 7; rank >= 0; rank--) {
+    for (i32 file = 0; file < 8; file++) {
+      i32 sq = rank * 8 + file;
+      u64 bb = 1ULL << sq;
+      i32 piece = piece_on(&npos, sq);
+      if (bb & npos.colour[0]) {
+        if (piece == Pawn) {
+          putl("P");
+        } else if (piece == Knight) {
+          putl("N");
+        } else if (piece == Bishop) {
+          putl("B");
+        } else if (piece == Rook) {
+          putl("R");
+        } else if (piece == Queen) {
+          putl("Q");
+        } else if (piece == King) {
+          putl("K");
+        }
+      } else if (bb & npos.colour[1]) {
+        if (piece == Pawn) {
+          putl("p");
+        } else if (piece == Knight) {
+          putl("n");
+        } else if (piece == Bishop) {
+          putl("b");
+        } else if (piece == Rook) {
+          putl("r");
+        } else if (piece == Queen) {
+          putl("q");
+        } else if (piece == King) {
+          putl("k");
+        }
+      } else {
+        putl(".");
+      }
+    }
+    putl("\n");
+  }
+  putl("\nTurn: ");
+  putl(pos->flipped ? "Black" : "White");
+  putl("\nEval: ");
+  i32 score = eval(pos);
+  if (pos->flipped) {
+    score = -score;
+  }
+  printf("%i\n", score);
+}
+
+#ifdef FULL
+// The root moves of a perft, handed out one at a time to the worker threads
+typedef struct [[nodiscard]] {
+  Position pos;
+  i32 depth;
+  i32 num_moves;
+  i32 next;
+  Move moves[max_moves];
+  u64 nodes[max_moves];
+} PerftRoot;
+
+static void *perft_worker(void *const arg) {
+  PerftRoot *const root = arg;
+  for (i32 i; (i = __atomic_fetch_add(&root->next, 1, __ATOMIC_RELAXED)) <
+              root->num_moves;) {
+    Position npos = root->pos;
+    play_move(&npos, &root->moves[i]);
+    root->nodes[i] = perft(&npos, root->depth - 1);
+  }
+  return NULL;
+}
+
+// Perft with the root moves split across the search threads, optionally
+// listing the count under each root move
+[[nodiscard]] static u64 perft_root(const Position *const restrict pos,
+                                    const i32 depth, const bool divide) {
+  if (depth < 1) {
+    return 1;
+  }
+
+  static PerftRoot root;
+  root = (PerftRoot){.pos = *pos, .depth = depth};
+  root.num_moves = movegen_legal(pos, root.moves);
+
+#ifdef HOSTED
+  pthread_t workers[max_threads];
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_create(&workers[i], NULL, perft_worker, &root);
+  }
+  perft_worker(&root);
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+#else
+  perft_worker(&root);
+#endif
+
+  u64 nodes = 0;
+  for (i32 i = 0; i < root.num_moves; i++) {
+    nodes += root.nodes[i];
+    if (divide) {
+      char move_name[8];
+      move_str(move_name, &root.moves[i], pos->flipped);
+      putl(move_name);
+      printf(": %i\n", root.nodes[i]);
+    }
+  }
+  return nodes;
+}
+
+static void perft_command(const Position *const restrict pos, const i32 depth,
+                          const bool divide) {
+  const u64 start = get_time();
+  const u64 nodes = perft_root(pos, depth, divide);
+  const u64 elapsed = get_time() - start;
+  const u64 nps = elapsed ? 1000 * nodes / elapsed : 0;
+  printf("info depth %i nodes %i time %i nps %i \n", depth, nodes, elapsed,
+         nps);
+}
+
+// Reference positions with known counts, the move generator regression gate
+static const struct {
+  const char *fen;
+  i32 depth;
+  u64 nodes;
+} perft_positions[] = {
+    {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 6,
+     119060324},
+    {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 5,
+     193690690},
+    {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 7, 178633661},
+    {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 5,
+     15833292},
+    {"r2q1rk1/pP1p2pp/Q4n2/bbp1p3/Np6/1B3NBn/pPPP1PPP/R3K2R b KQ - 0 1", 5,
+     15833292},
+    {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 5, 89941194},
+    {"n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b - - 0 1", 6, 71179139},
+    {"3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1", 6, 1134888},
+    {"8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1", 6, 1015133},
+    {"8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1", 6, 1440467},
+    {"5k2/8/8/8/8/8/8/4K2R w K - 0 1", 6, 661072},
+    {"3k4/8/8/8/8/8/8/R3K3 w Q - 0 1", 6, 803711},
+    {"r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1", 4, 1274206},
+    {"r3k2r/8/3Q4/8/8/5q2/8/R3K2R b KQkq - 0 1", 4, 1720476},
+    {"2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1", 6, 3821001},
+    {"8/8/1P2K3/8/2n5/1q6/8/5k2 b - - 0 1", 5, 1004658},
+    {"4k3/1P6/8/8/8/8/K7/8 w - - 0 1", 6, 217342},
+    {"8/P1k5/K7/8/8/8/8/8 w - - 0 1", 6, 92683},
+    {"K1k5/8/P7/8/8/8/8/8 w - - 0 1", 6, 2217},
+    {"8/k1P5/8/1K6/8/8/8/8 w - - 0 1", 7, 567584},
+    {"8/8/2k5/5q2/5n2/8/5K2/8 b - - 0 1", 4, 23527},
+};
+
+// Runs every reference position, returning the number that did not match
+static i32 perft_suite() {
+  enum { num_positions = sizeof(perft_positions) / sizeof(*perft_positions) };
+  __builtin_memset(perft_tt, 0, sizeof(perft_tt));
+  u64 total_nodes = 0;
+  i32 failed = 0;
+  const u64 start = get_time();
+  for (i32 i = 0; i < num_positions; i++) {
+    Position pos;
+    set_fen(&pos, perft_positions[i].fen);
+    const u64 position_start = get_time();
+    const u64 nodes = perft_root(&pos, perft_positions[i].depth, false);
+    const u64 elapsed = get_time() - position_start;
+    total_nodes += nodes;
+    failed += nodes != perft_positions[i].nodes;
+    printf("%i depth %i nodes %i time %i ", i + 1, perft_positions[i].depth,
+           nodes, elapsed);
+    putl(nodes == perft_positions[i].nodes ? "ok\n" : "FAILED\n");
+  }
+  const u64 elapsed = get_time() - start;
+  const u64 nps = elapsed ? 1000 * total_nodes / elapsed : 0;
+  printf("%i nodes %i nps %i failed\n", total_nodes, nps, failed);
+  return failed;
+}
+
+// Middlegame and endgame positions searched by bench. The total node count
+// over all of them is the signature of the search.
+static const char *const bench_fens[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 11",
+    "4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b - - 7 19",
+    "rq3rk1/ppp2ppp/1bnpb3/3N2B1/3NP3/7P/PPPQ1PP1/2KR3R w - - 7 14",
+    "r1bq1r1k/1pp1n1pp/1p1p4/4p2Q/4Pp2/1BNP4/PPP2PPP/3R1RK1 w - - 2 14",
+    "r3r1k1/2p2ppp/p1p1bn2/8/1q2P3/2NPQN2/PPP3PP/R4RK1 b - - 2 15",
+    "r1bbk1nr/pp3p1p/2n5/1N4p1/2Np1B2/8/PPP2PPP/2KR1B1R w kq - 0 13",
+    "r1bq1rk1/ppp1nppp/4n3/3p3Q/3P4/1BP1B3/PP1N2PP/R4RK1 w - - 1 16",
+    "4r1k1/r1q2ppp/ppp2n2/4P3/5Rb1/1N1BQ3/PPP3PP/R5K1 w - - 1 17",
+    "2rqkb1r/ppp2p2/2npb1p1/1N1Nn2p/2P1PP2/8/PP2B1PP/R1BQK2R b KQ - 0 11",
+    "r1bq1r1k/b1p1npp1/p2p3p/1p6/3PP3/1B2NN2/PP3PPP/R2Q1RK1 w - - 1 16",
+    "3r1rk1/p5pp/bpp1pp2/8/q1PP1P2/b3P3/P2NQRPP/1R2B1K1 b - - 6 22",
+    "r1q2rk1/2p1bppp/2Pp4/p6b/Q1PNp3/4B3/PP1R1PPP/2K4R w - - 2 18",
+    "4k2r/1pb2ppp/1p2p3/1R1p4/3P4/2r1PN2/P4PPP/1R4K1 b - - 3 22",
+    "3q2k1/pb3p1p/4pbp1/2r5/PpN2N2/1P2P2P/5PP1/Q2R2K1 b - - 4 26",
+    "6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/8 b - - 0 1",
+    "3b4/5kp1/1p1p1p1p/pP1PpP1P/P1P1P3/3KN3/8/8 w - - 0 1",
+    "2K5/p7/7P/5pR1/8/5k2/r7/8 w - - 0 1",
+    "8/6pk/1p6/8/PP3p1p/5P2/4KP1q/3Q4 w - - 0 1",
+    "7k/3p2pp/4q3/8/4Q3/5Kp1/P6b/8 w - - 0 1",
+    "8/2p5/8/2kPKp1p/2p4P/2P5/3P4/8 w - - 0 1",
+    "8/1p3pp1/7p/5P1P/2k3P1/8/2K2P2/8 w - - 0 1",
+    "8/pp2r1k1/2p1p3/3pP2p/1P1P1P1P/P5KR/8/8 w - - 0 1",
+    "8/3p4/p1bk3p/Pp6/1Kp1PpPp/2P2P1P/2P5/5B2 b - - 0 1",
+    "5k2/7R/4P2p/5K2/p1r2P1p/8/8/8 b - - 0 1",
+    "6k1/6p1/P6p/r1N5/5p2/7P/1b3PP1/4R1K1 w - - 0 1",
+    "1r3k2/4q3/2Pp3b/3Bp3/2Q2p2/1p1P2P1/1P2KP2/3N4 w - - 0 1",
+    "6k1/4pp1p/3p2p1/P1pPb3/R7/1r2P1PP/3B1P2/6K1 w - - 0 1",
+    "8/3p3B/5p2/5P2/p7/PP5b/k7/6K1 w - - 0 1",
+    "5rk1/q6p/2p3bR/1pPp1rP1/1P1Pp3/P3B1Q1/1K3P2/R7 w - - 93 90",
+    "4rrk1/1p1nq3/p7/2p1P1pp/3P2bp/3Q1Bn1/PPPB4/1K2R1NR w - - 40 21",
+    "r3k2r/3nnpbp/q2pp1p1/p7/Pp1PPPP1/4BNN1/1P5P/R2Q1RK1 w kq - 0 16",
+    "3Qb1k1/1r2ppb1/pN1n2q1/Pp1Pp1Pr/4P2p/4BP2/4B1R1/1R5K b - - 11 40",
+    "4k3/3q1r2/1N2r1b1/3ppN2/2nPP3/1B1R2n1/2R1Q3/3K4 w - - 5 1",
+    "8/8/8/8/5kp1/P7/8/1K1N4 w - - 0 1",
+    "8/8/8/5N2/8/p7/8/2NK3k w - - 0 1",
+    "8/3k4/8/8/8/4B3/4KB2/2B5 w - - 0 1",
+    "8/8/1P6/5pr1/8/4R3/7k/2K5 w - - 0 1",
+    "8/2p4P/8/kr6/6R1/8/8/1K6 w - - 0 1",
+    "8/8/3P3k/8/1p6/8/1P6/1K3n2 b - - 0 1",
+    "8/R7/2q5/8/6k1/8/1P5p/K6R w - - 0 124",
+    "6k1/3b3r/1p1p4/p1n2p2/1PPNpP1q/P3Q1p1/1R1RB1P1/5K2 b - - 0 1",
+    "r2r1n2/pp2bk2/2p1p2p/3q4/3PN1QP/2P3R1/P4PP1/5RK1 w - - 0 1",
+    "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P3/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "8/8/8/8/8/6k1/6p1/6K1 w - - 0 1",
+    "7k/7P/6K1/8/3B4/8/8/8 b - - 0 1",
+};
+
+enum { bench_depth = 12 };
+enum { Output_Plain, Output_Csv, Output_Json };
+
+// Fixed depth search of every bench position from a cleared table, so the
+// node counts only change with the search itself. CSV and JSON output list
+// each position for comparing builds.
+static u64 bench(const i32 depth, const i32 output) {
+  enum { num_positions = sizeof(bench_fens) / sizeof(*bench_fens) };
+#ifdef LOWSTACK
+  SearchStack *stack = malloc(sizeof(SearchStack) * 1024);
+#else
+  SearchStack stack[1024];
+#endif
+
+  limits = no_limits;
+  clear_tt();
+  quiet = true;
+  if (output == Output_Csv) {
+    putl("position,depth,nodes,time,nps\n");
+  } else if (output == Output_Json) {
+    printf("{\"depth\":%i,\"positions\":[", depth);
+  }
+
+  u64 total_nodes = 0;
+  u64 total_time = 0;
+  for (i32 i = 0; i < num_positions; i++) {
+    Position pos;
+    set_fen(&pos, bench_fens[i]);
+    for (i32 ply = 0; ply < max_ply; ply++) {
+      stack[ply].killer = (Move){0};
+    }
+
+#ifdef HOSTED
+    stop = false;
+#endif
+    u64 nodes = 0;
+    const u64 start = get_time();
+    iteratively_deepen(depth + 1, &nodes, &pos, stack, 0);
+    const u64 elapsed = get_time() - start;
+    const u64 nps = elapsed ? 1000 * nodes / elapsed : 0;
+    total_nodes += nodes;
+    total_time += elapsed;
+
+    if (output == Output_Csv) {
+      printf("%i,%i,%i,%i,%i\n", i + 1, depth, nodes, elapsed, nps);
+    } else if (output == Output_Json) {
+      putl(i ? "," : "");
+      printf("{\"position\":%i,\"nodes\":%i,\"time\":%i,\"nps\":%i}",
+             i + 1, nodes, elapsed, nps);
+    }
+  }
+  quiet = false;
+
+  const u64 nps = total_time ? 1000 * total_nodes / total_time : 0;
+  if (output == Output_Csv) {
+    printf("total,%i,%i,%i,%i\n", depth, total_nodes, total_time, nps);
+  } else if (output == Output_Json) {
+    printf("],\"nodes\":%i,\"time\":%i,\"nps\":%i}\n", total_nodes,
+           total_time, nps);
+  } else {
+    printf("%i nodes %i nps\n", total_nodes, nps);
+  }
+  return total_nodes;
+}
+
+// Cost of the AES hash against the Zobrist key, over the positions of a
+// breadth first walk from pos
+static void hash_bench(const Position *const pos) {
+  enum { corpus_length = 8192, repetitions = 256 };
+  static Position corpus[corpus_length];
+  static Move first_moves[corpus_length];
+  i32 length = 1;
+  corpus[0] = *pos;
+  for (i32 i = 0; i < length && length < corpus_length; i++) {
+    Move moves[max_moves];
+    const i32 num_moves = movegen(&corpus[i], moves, false);
+    for (i32 j = 0; j < num_moves && length < corpus_length; j++) {
+      corpus[length] = corpus[i];
+      length += makemove(&corpus[length], &moves[j]);
+    }
+  }
+
+  // Keep the positions with a legal move to replay
+  i32 playable = 0;
+  for (i32 i = 0; i < length; i++) {
+    Move moves[max_moves];
+    const i32 num_moves = movegen(&corpus[i], moves, false);
+    for (i32 j = 0; j < num_moves; j++) {
+      Position npos = corpus[i];
+      if (makemove(&npos, &moves[j])) {
+        corpus[playable] = corpus[i];
+        first_moves[playable++] = moves[j];
+        break;
+      }
+    }
+  }
+  length = playable;
+
+  u64 sum = 0;
+  for (i32 method = 0; method < 4; method++) {
+    const u64 start = get_time();
+    for (i32 r = 0; r < repetitions; r++) {
+      for (i32 i = 0; i < length; i++) {
+        if (method == 0) {
+          sum += get_hash(&corpus[i]);
+        } else if (method == 1) {
+          sum += get_key(&corpus[i]);
+        } else if (method == 2) {
+          sum += key_after(&corpus[i], &first_moves[i]);
+        } else {
+          // Includes the incremental key update
+          Position npos = corpus[i];
+          sum += makemove(&npos, &first_moves[i]);
+        }
+      }
+    }
+    const u64 elapsed = get_time() - start;
+    putl((const char *[]){"get_hash", "get_key", "key_after",
+                          "makemove"}[method]);
+    printf(" %i ps/call\n", elapsed * 1000000000 / ((u64)repetitions * length));
+  }
+  printf("checksum %i\n", (i32)sum);
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+// Cycles per call of the primitives under the search, each over the bench
+// positions in isolation. Every run is warmed up, then timed several times
+// with rdtsc, reporting the median and the spread between runs. The ray
+// sliders are the ones the MINI build uses in place of the lookups.
+enum { micro_runs = 25, micro_passes = 64, micro_max_moves = 4096 };
+
+static Position micro_positions[sizeof(bench_fens) / sizeof(*bench_fens)];
+static i32 micro_num_positions;
+static struct {
+  i32 pos;
+  Move move;
+} micro_moves[micro_max_moves];
+static i32 micro_num_moves;
+static volatile u64 micro_sink;
+
+static i32 micro_movegen() {
+  Move moves[max_moves];
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    micro_sink += movegen(&micro_positions[i], moves, false);
+  }
+  return micro_num_positions;
+}
+
+static i32 micro_movegen_legal() {
+  Move moves[max_moves];
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    micro_sink += movegen_legal(&micro_positions[i], moves);
+  }
+  return micro_num_positions;
+}
+
+static i32 micro_makemove() {
+  for (i32 i = 0; i < micro_num_moves; i++) {
+    Position npos = micro_positions[micro_moves[i].pos];
+    micro_sink += makemove(&npos, &micro_moves[i].move);
+  }
+  return micro_num_moves;
+}
+
+static i32 micro_eval() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    Position pos = micro_positions[i];
+    micro_sink += eval(&pos);
+  }
+  return micro_num_positions;
+}
+
+static i32 micro_eval_incremental() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    micro_sink += eval_incremental(&micro_positions[i]);
+  }
+  return micro_num_positions;
+}
+
+static i32 micro_get_hash() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    micro_sink += get_hash(&micro_positions[i]);
+  }
+  return micro_num_positions;
+}
+
+static i32 micro_is_attacked() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    const Position *const pos = &micro_positions[i];
+    micro_sink +=
+        is_attacked(pos, lsb(pos->colour[0] & pos->pieces[King]), true);
+  }
+  return micro_num_positions;
+}
+
+static i32 micro_bishop() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    const u64 all = micro_positions[i].colour[0] | micro_positions[i].colour[1];
+    for (i32 sq = 0; sq < 64; sq++) {
+      micro_sink += bishop(sq, all);
+    }
+  }
+  return micro_num_positions * 64;
+}
+
+static i32 micro_rook() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    const u64 all = micro_positions[i].colour[0] | micro_positions[i].colour[1];
+    for (i32 sq = 0; sq < 64; sq++) {
+      micro_sink += rook(sq, all);
+    }
+  }
+  return micro_num_positions * 64;
+}
+
+static i32 micro_bishop_rays() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    const u64 all = micro_positions[i].colour[0] | micro_positions[i].colour[1];
+    for (i32 sq = 0; sq < 64; sq++) {
+      micro_sink += bishop_rays(sq, all);
+    }
+  }
+  return micro_num_positions * 64;
+}
+
+static i32 micro_rook_rays() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    const u64 all = micro_positions[i].colour[0] | micro_positions[i].colour[1];
+    for (i32 sq = 0; sq < 64; sq++) {
+      micro_sink += rook_rays(sq, all);
+    }
+  }
+  return micro_num_positions * 64;
+}
+
+static i32 micro_flip_pos() {
+  for (i32 i = 0; i < micro_num_positions; i++) {
+    Position pos = micro_positions[i];
+    flip_pos(&pos);
+    micro_sink += pos.colour[0];
+  }
+  return micro_num_positions;
+}
+
+static const struct {
+  const char *name;
+  i32 (*run)();
+} micro_benches[] = {
+    {"movegen", micro_movegen},
+    {"movegen_legal", micro_movegen_legal},
+    {"makemove", micro_makemove},
+    {"eval", micro_eval},
+    {"eval_incremental", micro_eval_incremental},
+    {"get_hash", micro_get_hash},
+    {"is_attacked", micro_is_attacked},
+    {"bishop", micro_bishop},
+    {"rook", micro_rook},
+    {"bishop_rays", micro_bishop_rays},
+    {"rook_rays", micro_rook_rays},
+    {"flip_pos", micro_flip_pos},
+};
+
+// rdtsc fenced on both sides, so the timed work neither starts before the
+// read nor is still running past it
+static u64 micro_cycles() {
+  __builtin_ia32_lfence();
+  const u64 cycles = __builtin_ia32_rdtsc();
+  __builtin_ia32_lfence();
+  return cycles;
+}
+
+static void microbench() {
+  micro_num_positions = 0;
+  micro_num_moves = 0;
+  for (i32 i = 0; i < (i32)(sizeof(bench_fens) / sizeof(*bench_fens)); i++) {
+    Position *const pos = &micro_positions[micro_num_positions++];
+    set_fen(pos, bench_fens[i]);
+    Move moves[max_moves];
+    const i32 num_moves = movegen(pos, moves, false);
+    for (i32 j = 0; j < num_moves && micro_num_moves < micro_max_moves; j++) {
+      micro_moves[micro_num_moves].pos = i;
+      micro_moves[micro_num_moves++].move = moves[j];
+    }
+  }
+
+  for (i32 i = 0; i < (i32)(sizeof(micro_benches) / sizeof(*micro_benches));
+       i++) {
+    u64 cycles[micro_runs];
+    i32 calls = 0;
+    for (i32 pass = 0; pass < micro_passes; pass++) {
+      calls = micro_benches[i].run();
+    }
+    for (i32 run = 0; run < micro_runs; run++) {
+      const u64 start = micro_cycles();
+      for (i32 pass = 0; pass < micro_passes; pass++) {
+        micro_benches[i].run();
+      }
+      // In hundredths of a cycle per call
+      cycles[run] =
+          100 * (micro_cycles() - start) / (micro_passes * calls);
+
+      // Insertion sort as the runs come in
+      for (i32 j = run; j > 0 && cycles[j - 1] > cycles[j]; j--) {
+        swapu64(&cycles[j - 1], &cycles[j]);
+      }
+    }
+
+    const u64 low = cycles[micro_runs / 10];
+    const u64 median = cycles[micro_runs / 2];
+    const u64 high = cycles[micro_runs - 1 - micro_runs / 10];
+    putl(micro_benches[i].name);
+    printf(" calls %i median %i.%i p10 %i.%i p90 %i.%i cycles\n", calls,
+           median / 100, median / 10 % 10, low / 100, low / 10 % 10,
+           high / 100, high / 10 % 10);
+  }
+}
+#endif
+
+#ifdef HOSTED
+// Time to depth and NPS scaling of the bench search over 1, 2, 4, ... threads
+static void smp_bench(i32 max_thread_count) {
+  max_thread_count = max_thread_count < 1             ? 1
+                     : max_thread_count > max_threads ? max_threads
+                                                      : max_thread_count;
+  const i32 previous_threads = num_threads;
+  u64 single_thread_time = 0;
+  for (i32 thread_count = 1;; thread_count *= 2) {
+    if (thread_count > max_thread_count) {
+      thread_count = max_thread_count;
+    }
+    clear_tt();
+    num_threads = thread_count;
+    const u64 start = get_time();
+    const u64 nodes = bench(bench_depth, Output_Plain);
+    const u64 elapsed = get_time() - start;
+    if (thread_count == 1) {
+      single_thread_time = elapsed;
+    }
+    printf("threads %i time %llu nodes %llu nps %llu speedup %.2f\n",
+           thread_count, elapsed, nodes, elapsed ? 1000 * nodes / elapsed : 0,
+           elapsed ? (double)single_thread_time / elapsed : 0.0);
+    if (thread_count == max_thread_count) {
+      break;
+    }
+  }
+  num_threads = previous_threads;
+}
+
+// Time to depth over the bench positions from an empty table, then again from
+// the table saved after that pass and loaded back, as on a restart
+static void warm_bench(const i32 depth) {
+  enum { num_positions = sizeof(bench_fens) / sizeof(*bench_fens) };
+  static const char path[] = "warmbench.hash";
+  SearchStack *const stack = malloc(sizeof(SearchStack) * 1024);
+  u64 pass_nodes[2] = {0};
+  u64 pass_time[2] = {0};
+  limits = no_limits;
+  clear_tt();
+  quiet = true;
+  for (i32 pass = 0; pass < 2; pass++) {
+    if (pass) {
+      save_tt(path);
+      clear_tt();
+      load_tt(path);
+      unlink(path);
+    }
+    for (i32 i = 0; i < num_positions; i++) {
+      Position pos;
+      set_fen(&pos, bench_fens[i]);
+      for (i32 ply = 0; ply < max_ply; ply++) {
+        stack[ply].killer = (Move){0};
+      }
+      stop = false;
+      u64 nodes = 0;
+      const u64 start = get_time();
+      iteratively_deepen(depth + 1, &nodes, &pos, stack, 0);
+      pass_time[pass] += get_time() - start;
+      pass_nodes[pass] += nodes;
+    }
+    printf("%s time %llu nodes %llu\n", pass ? "warm" : "cold",
+           pass_time[pass], pass_nodes[pass]);
+  }
+  quiet = false;
+  printf("time to depth %i speedup %.2f\n", depth,
+         pass_time[1] ? (double)pass_time[0] / pass_time[1] : 0.0);
+  free(stack);
+}
+#endif
+#ifdef HOSTED
+// Batch analysis of an EPD file: positions are read in chunks, spread over the
+// threads with a shared table, and each chunk is written out in input order.
+// Every thread keeps its own stack and move history across positions.
+enum { analyze_chunk = 1024 };
+
+typedef struct [[nodiscard]] {
+  char epd[128]; // Board, side, castling and en passant fields
+  Move best_move;
+  bool flipped;
+  i32 score;
+  u64 nodes;
+  u64 time;
+} AnalyzeEntry;
+
+static AnalyzeEntry analyze_entries[analyze_chunk];
+static i32 analyze_count;
+static i32 analyze_next;
+static i32 analyze_depth;
+static pthread_barrier_t analyze_barrier;
+
+static void analyze_part(SearchStack *const stack) {
+  i32 i;
+  while ((i = __atomic_fetch_add(&analyze_next, 1, __ATOMIC_RELAXED)) <
+         analyze_count) {
+    AnalyzeEntry *const entry = &analyze_entries[i];
+    Position pos;
+    set_fen(&pos, entry->epd);
+    for (i32 ply = 0; ply < max_ply; ply++) {
+      stack[ply].killer = (Move){0};
+    }
+    stack[0].best_move = (Move){0};
+
+    entry->nodes = 0;
+    entry->score = 0;
+    const u64 start = get_time();
+    for (i32 depth = 1; depth <= analyze_depth; depth++) {
+      entry->score = search(&pos, 0, depth, -inf, inf, &entry->nodes, stack,
+                            0, false);
+    }
+    entry->time = get_time() - start;
+    entry->best_move = stack[0].best_move;
+    entry->flipped = pos.flipped;
+  }
+}
+
+static void *analyze_worker(void *const arg) {
+  SearchStack *const stack = arg;
+  __builtin_memset(move_history, 0, sizeof(move_history));
+  next_poll = -1;
+  while (true) {
+    pthread_barrier_wait(&analyze_barrier);
+    if (!analyze_count) {
+      return NULL;
+    }
+    analyze_part(stack);
+    pthread_barrier_wait(&analyze_barrier);
+  }
+}
+
+// Reads the next chunk of positions, skipping blank lines and comments, and
+// keeping only the first four fields of each
+[[nodiscard]] static i32 read_epd_chunk(FILE *const file) {
+  char line[4096];
+  analyze_count = 0;
+  while (analyze_count < analyze_chunk && fgets(line, sizeof line, file)) {
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || !line[0]) {
+      continue;
+    }
+    char *const epd = analyze_entries[analyze_count].epd;
+    i32 length = 0;
+    for (i32 fields = 0; line[length] && line[length] != '\n' &&
+                         line[length] != '\r' &&
+                         length < (i32)sizeof analyze_entries->epd - 1;
+         length++) {
+      if (line[length] == ' ' && ++fields == 4) {
+        break;
+      }
+      epd[length] = line[length];
+    }
+    epd[length] = 0;
+    analyze_count++;
+  }
+  return analyze_count;
+}
+
+static void write_epd_chunk(FILE *const file) {
+  for (i32 i = 0; i < analyze_count; i++) {
+    const AnalyzeEntry *const entry = &analyze_entries[i];
+    char move_name[8] = "0000";
+    if (entry->best_move.from != entry->best_move.to) {
+      move_str(move_name, &entry->best_move, entry->flipped);
+    }
+    fprintf(file, "%s; bestmove %s; score %i; nodes %llu; time %llu\n",
+            entry->epd, move_name, entry->score, entry->nodes, entry->time);
+  }
+  fflush(file);
+}
+
+// 4kc analyze input.epd [--output file] [--depth n] [--threads n] [--hash mb]
+static void analyze(const i32 argc, char **const argv) {
+  const char *output_name = NULL;
+  analyze_depth = 10;
+  for (i32 i = 3; i + 1 < argc; i += 2) {
+    const i32 value = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--output")) {
+      output_name = argv[i + 1];
+    } else if (!strcmp(argv[i], "--depth")) {
+      analyze_depth = value < 1 ? 1 : value >= max_ply ? max_ply - 1 : value;
+    } else if (!strcmp(argv[i], "--threads")) {
+      num_threads = value < 1             ? 1
+                    : value > max_threads ? max_threads
+                                          : value;
+    } else if (!strcmp(argv[i], "--hash")) {
+      resize_tt(value < 1 ? 1 : value > max_hash ? max_hash : value);
+    }
+  }
+
+  FILE *const input = fopen(argv[2], "r");
+  FILE *const output = output_name ? fopen(output_name, "w") : stdout;
+  if (!input || !output) {
+    fprintf(stderr, "Cannot open %s\n", input ? output_name : argv[2]);
+    return;
+  }
+
+  limits = no_limits;
+  stop = false;
+  detach_tt_file();
+  clear_tt();
+  pthread_barrier_init(&analyze_barrier, NULL, num_threads);
+  for (i32 i = 1; i < num_threads; i++) {
+    if (!threads[i].stack) {
+      threads[i].stack = malloc(sizeof(SearchStack) * 1024);
+    }
+    pthread_create(&threads[i].handle, NULL, analyze_worker, threads[i].stack);
+  }
 
-  // TT PROBING
-  TTEntry *tt_entry = &tt[tt_hash % tt_length];
-  const u16 tt_hash_partial = tt_hash / tt_length;
-  Move tt_move = {0};
-  if (tt_entry->partial_hash == tt_hash_partial) {
-    tt_move = tt_entry->move;
+  SearchStack *const stack = malloc(sizeof(SearchStack) * 1024);
+  __builtin_memset(move_history, 0, sizeof(move_history));
+  next_poll = -1;
+  while (read_epd_chunk(input)) {
+    tt_age = tt_age % age_mask + 1;
+    analyze_next = 0;
+    pthread_barrier_wait(&analyze_barrier);
+    analyze_part(stack);
+    pthread_barrier_wait(&analyze_barrier);
+    write_epd_chunk(output);
+  }
 
-    // TT PRUNING
-    if (alpha == beta - 1 && tt_entry->depth >= depth &&
-        tt_entry->flag != tt_entry->score <= alpha) {
-      return tt_entry->score;
+  // Release the workers waiting on the next chunk
+  pthread_barrier_wait(&analyze_barrier);
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_join(threads[i].handle, NULL);
+  }
+  pthread_barrier_destroy(&analyze_barrier);
+  free(stack);
+  fclose(input);
+  if (output != stdout) {
+    fclose(output);
+  }
+}
+
+// Self-play data generation. Each thread plays games from a few random plies
+// off the start position, searching every move to a soft node limit, and
+// writes the quiet positions of finished games with their scores and the
+// game result. Positions are packed into 32 bytes.
+enum {
+  datagen_max_plies = 400,
+  datagen_win_score = 2000, // Adjudicated after this many plies beyond it
+  datagen_win_plies = 8
+};
+
+typedef struct [[nodiscard]] __attribute__((packed)) {
+  u64 occupancy;  // Real squares, a1 first
+  u8 pieces[16];  // A nibble per occupied square in order, type - 1 and black
+                  // in bit 3
+  u8 stm_ep;      // Black to move in bit 7, en passant square or 64 below
+  u8 halfmove;    // Plies since a capture or pawn move
+  u16 fullmove;
+  i16 score;      // From white's point of view
+  u8 result;      // 0 black wins, 1 draw, 2 white wins
+  u8 castling;    // White short and long, then black short and long
+} PackedBoard;
+
+_Static_assert(sizeof(PackedBoard) == 32, "PackedBoard is 32 bytes");
+
+static FILE *datagen_output;
+static pthread_mutex_t datagen_lock = PTHREAD_MUTEX_INITIALIZER;
+static i32 datagen_games;
+static i32 datagen_next;
+static i32 datagen_random_plies;
+static u64 datagen_nodes;
+static u64 datagen_seed;
+static u64 datagen_positions;
+static i32 datagen_finished;
+
+[[nodiscard]] static PackedBoard pack_board(const Position *const pos,
+                                            const i32 score,
+                                            const i32 halfmove,
+                                            const i32 fullmove) {
+  Position real = *pos;
+  if (real.flipped) {
+    flip_pos(&real);
+  }
+  PackedBoard board = {.occupancy = real.colour[0] | real.colour[1],
+                       .stm_ep = pos->flipped << 7 | 64,
+                       .halfmove = halfmove,
+                       .fullmove = fullmove,
+                       .score = pos->flipped ? -score : score};
+  i32 i = 0;
+  for (u64 bb = board.occupancy; bb; bb &= bb - 1, i++) {
+    const i32 sq = lsb(bb);
+    const i32 code = piece_on(&real, sq) - 1 | (real.colour[1] >> sq & 1) << 3;
+    board.pieces[i / 2] |= code << 4 * (i % 2);
+  }
+  if (pos->ep) {
+    board.stm_ep = pos->flipped << 7 | (lsb(pos->ep) ^ 56 * pos->flipped);
+  }
+  for (i32 c = 0; c < 4; c++) {
+    board.castling |= real.castling[c] << c;
+  }
+  return board;
+}
+
+// Writes the first four FEN fields of a packed board
+static void unpack_board(const PackedBoard *const board, char *fen) {
+  char squares[64] = {0};
+  i32 i = 0;
+  for (u64 bb = board->occupancy; bb; bb &= bb - 1, i++) {
+    const i32 code = board->pieces[i / 2] >> 4 * (i % 2) & 0xF;
+    squares[lsb(bb)] = "PNBRQK??pnbrqk??"[code];
+  }
+  for (i32 rank = 7; rank >= 0; rank--) {
+    for (i32 file = 0; file < 8; file++) {
+      if (squares[rank * 8 + file]) {
+        *fen++ = squares[rank * 8 + file];
+      } else if (file && fen[-1] >= '1' && fen[-1] <= '7') {
+        fen[-1]++;
+      } else {
+        *fen++ = '1';
+      }
     }
+    *fen++ = rank ? '/' : ' ';
+  }
+  *fen++ = board->stm_ep >> 7 ? 'b' : 'w';
+  *fen++ = ' ';
+  if (!(board->castling & 0xF)) {
+    *fen++ = '-';
+  }
+  for (i32 c = 0; c < 4; c++) {
+    if (board->castling >> c & 1) {
+      *fen++ = "KQkq"[c];
+    }
+  }
+  *fen++ = ' ';
+  const i32 ep = board->stm_ep & 0x7F;
+  if (ep < 64) {
+    *fen++ = 'a' + ep % 8;
+    *fen++ = '1' + ep / 8;
   } else {
-    // INTERNAL ITERATIVE REDUCTION
-    depth -= depth > 3;
+    *fen++ = '-';
   }
+  *fen = 0;
+}
 
-  // STATIC EVAL WITH ADJUSTMENT FROM TT
-  i32 static_eval = eval(pos);
-  if (tt_entry->flag != static_eval > tt_entry->score &&
-      tt_entry->partial_hash == tt_hash_partial) {
-    static_eval = tt_entry->score;
+[[nodiscard]] static u64 datagen_random(u64 *const state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Plays one game, returning the number of positions kept in boards and the
+// result from white's point of view. An opening that ends the game early
+// keeps no positions.
+[[nodiscard]] static i32 datagen_game(SearchStack *const stack,
+                                      PackedBoard *const boards,
+                                      u64 *const rng) {
+  Position pos;
+  set_fen(&pos, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq -");
+  Move moves[max_moves];
+  for (i32 ply = 0; ply < datagen_random_plies; ply++) {
+    const i32 num_moves = movegen_legal(&pos, moves);
+    if (!num_moves) {
+      return 0;
+    }
+    play_move(&pos, &moves[datagen_random(rng) % num_moves]);
   }
 
-  // QUIESCENCE
-  if (in_qsearch && static_eval > alpha) {
-    if (static_eval >= beta) {
-      return static_eval;
+  for (i32 ply = 0; ply < max_ply; ply++) {
+    stack[ply].killer = (Move){0};
+  }
+  i32 num_boards = 0;
+  i32 pos_history_count = 0;
+  i32 winning_plies = 0;
+  i32 result = 1;
+  for (i32 ply = datagen_random_plies; ply < datagen_max_plies; ply++) {
+    const bool in_check =
+        is_attacked(&pos, lsb(pos.colour[0] & pos.pieces[King]), true);
+    if (!movegen_legal(&pos, moves)) {
+      result = in_check ? pos.flipped ? 2 : 0 : 1;
+      break;
+    }
+    bool repeated = false;
+    for (i32 i = 0; i < pos_history_count; i++) {
+      repeated |= key_history[i] == pos.key;
+    }
+    if (repeated || pos.halfmove >= 100 ||
+        count(pos.colour[0] | pos.colour[1]) == 2) {
+      break;
+    }
+
+    // Deepen until the node budget is spent. The first iteration always
+    // completes, so there is a move; a later one aborts at the budget and
+    // leaves the score of the last complete one.
+    u64 nodes = 0;
+    i32 score = 0;
+    stack[0].best_move = (Move){0};
+    node_cap = -1;
+    for (i32 depth = 1; depth < max_ply && nodes < datagen_nodes; depth++) {
+      const i32 iteration_score = search(&pos, 0, depth, -inf, inf, &nodes,
+                                         stack, pos_history_count, false);
+      if (nodes >= node_cap) {
+        break;
+      }
+      score = iteration_score;
+      node_cap = datagen_nodes;
+    }
+    node_cap = -1;
+    const Move best_move = stack[0].best_move;
+
+    winning_plies = score > datagen_win_score || score < -datagen_win_score
+                        ? winning_plies + 1
+                        : 0;
+    if (winning_plies >= datagen_win_plies) {
+      result = (score > 0) ^ pos.flipped ? 2 : 0;
+      break;
+    }
+    const bool noisy = best_move.takes_piece != None ||
+                       best_move.promo != None ||
+                       (pos.pieces[Pawn] >> best_move.from & 1 &&
+                        1ull << best_move.to == pos.ep);
+    if (!in_check && !noisy && score > -datagen_win_score &&
+        score < datagen_win_score) {
+      boards[num_boards++] =
+          pack_board(&pos, score, pos.halfmove, ply / 2 + 1);
+    }
+
+    // Captures and pawn moves end the history repetitions are looked for in
+    key_history[pos_history_count++] = pos.key;
+    play_move(&pos, &best_move);
+    if (!pos.halfmove) {
+      pos_history_count = 0;
     }
-    alpha = static_eval;
   }
 
-  if (!in_qsearch && depth < 8 && alpha == beta - 1 && !in_check) {
-    // REVERSE FUTILITY PRUNING
-    if (static_eval - 47 * depth >= beta) {
-      return static_eval;
+  for (i32 i = 0; i < num_boards; i++) {
+    boards[i].result = result;
+  }
+  return num_boards;
+}
+
+static void datagen_part(SearchStack *const stack, const i32 index) {
+  static per_thread PackedBoard boards[datagen_max_plies];
+  u64 rng = datagen_seed ^ (index + 1) * 0x9E3779B97F4A7C15ull;
+  rng |= !rng;
+  __builtin_memset(move_history, 0, sizeof(move_history));
+  next_poll = -1;
+  while (__atomic_fetch_add(&datagen_next, 1, __ATOMIC_RELAXED) <
+         datagen_games) {
+    const i32 num_boards = datagen_game(stack, boards, &rng);
+    pthread_mutex_lock(&datagen_lock);
+    fwrite(boards, sizeof(PackedBoard), num_boards, datagen_output);
+    datagen_positions += num_boards;
+    if (++datagen_finished % 100 == 0) {
+      fflush(datagen_output);
+      printf("info string games %i positions %llu\n", datagen_finished,
+             datagen_positions);
     }
+    pthread_mutex_unlock(&datagen_lock);
+  }
+}
 
-    // RAZORING
-    in_qsearch = static_eval + 131 * depth <= alpha;
+static void *datagen_worker(void *const arg) {
+  SearchThread *const thread = arg;
+  datagen_part(thread->stack, thread - threads);
+  return NULL;
+}
+
+// 4kc datagen output.bin [--games n] [--nodes n] [--threads n] [--hash mb]
+//                        [--random n] [--seed n]
+static void datagen(const i32 argc, char **const argv) {
+  datagen_games = 1000;
+  datagen_nodes = 5000;
+  datagen_random_plies = 8;
+  datagen_seed = get_time();
+  for (i32 i = 3; i + 1 < argc; i += 2) {
+    const i32 value = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--games")) {
+      datagen_games = value;
+    } else if (!strcmp(argv[i], "--nodes")) {
+      datagen_nodes = value < 1 ? 1 : value;
+    } else if (!strcmp(argv[i], "--threads")) {
+      num_threads = value < 1             ? 1
+                    : value > max_threads ? max_threads
+                                          : value;
+    } else if (!strcmp(argv[i], "--hash")) {
+      resize_tt(value < 1 ? 1 : value > max_hash ? max_hash : value);
+    } else if (!strcmp(argv[i], "--random")) {
+      datagen_random_plies = value < 0 ? 0 : value;
+    } else if (!strcmp(argv[i], "--seed")) {
+      datagen_seed = strtoull(argv[i + 1], NULL, 10);
+    }
   }
 
-  // NULL MOVE PRUNING
-  if (depth > 2 && do_null && static_eval >= beta && alpha == beta - 1 &&
-      !in_check) {
-    Position npos = *pos;
-    flip_pos(&npos);
-    npos.ep = 0;
-    if (-search(&npos, ply + 1, depth - 4, -beta, -alpha,
-#ifdef FULL
-                nodes,
-#endif
-                stack, pos_history_count, false) >= beta) {
-      return beta;
+  datagen_output = fopen(argv[2], "ab");
+  if (!datagen_output) {
+    fprintf(stderr, "Cannot open %s\n", argv[2]);
+    return;
+  }
+
+  limits = no_limits;
+  stop = false;
+  detach_tt_file();
+  clear_tt();
+  datagen_next = 0;
+  datagen_positions = 0;
+  datagen_finished = 0;
+  for (i32 i = 1; i < num_threads; i++) {
+    if (!threads[i].stack) {
+      threads[i].stack = malloc(sizeof(SearchStack) * 1024);
     }
+    pthread_create(&threads[i].handle, NULL, datagen_worker, &threads[i]);
+  }
+  SearchStack *const stack = malloc(sizeof(SearchStack) * 1024);
+  datagen_part(stack, 0);
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_join(threads[i].handle, NULL);
   }
+  free(stack);
+  fclose(datagen_output);
+  printf("info string games %i positions %llu\n", datagen_finished,
+         datagen_positions);
+}
 
-  stack[ply].num_moves = movegen(pos, stack[ply].moves, in_qsearch);
-  stack[ply].best_move = tt_move;
-  stack[pos_history_count + ply + 2].position_hash = tt_hash;
-  i32 moves_evaluated = 0;
-  i32 quiets_evaluated = 0;
-  u8 tt_flag = Upper;
-  i32 best_score = in_qsearch ? static_eval : -inf;
+// Converts packed positions to text, one "FEN | score | result" line each,
+// or to EPD with the score from the side to move and the result as c9
+// 4kc convert input.bin [--output file] [--epd]
+static void convert(const i32 argc, char **const argv) {
+  const char *output_name = NULL;
+  bool epd = false;
+  for (i32 i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "--epd")) {
+      epd = true;
+    } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+      output_name = argv[++i];
+    }
+  }
 
-  for (i32 move_index = 0; move_index < stack[ply].num_moves; move_index++) {
-    i32 move_score = ~0x1010101LL; // Ends up as large negative
+  FILE *const input = fopen(argv[2], "rb");
+  FILE *const output = output_name ? fopen(output_name, "w") : stdout;
+  if (!input || !output) {
+    fprintf(stderr, "Cannot open %s\n", input ? output_name : argv[2]);
+    return;
+  }
 
-    // MOVE ORDERING
-    for (i32 order_index = move_index; order_index < stack[ply].num_moves;
-         order_index++) {
-      assert(stack[ply].moves[order_index].takes_piece ==
-             piece_on(pos, stack[ply].moves[order_index].to));
-      const i32 order_move_score =
-          ((i32)move_equal(&tt_move, &stack[ply].moves[order_index])
-           << 30) // PREVIOUS BEST MOVE FIRST
-          + (i32)stack[ply].moves[order_index].takes_piece * 921 +
-          (i32)move_equal(&stack[ply].killer, &stack[ply].moves[order_index]) *
-              915 // KILLER MOVE
-          +
-          move_history[pos->flipped][stack[ply].moves[order_index].takes_piece]
-                      [stack[ply].moves[order_index].from]
-                      [stack[ply].moves[order_index].to]; // HISTORY HEURISTIC
-      if (order_move_score > move_score) {
-        move_score = order_move_score;
-        swapmoves(&stack[ply].moves[move_index],
-                  &stack[ply].moves[order_index]);
-      }
+  static const char *const results[3][2] = {
+      {"0.0", "0-1"}, {"0.5", "1/2-1/2"}, {"1.0", "1-0"}};
+  PackedBoard board;
+  while (fread(&board, sizeof board, 1, input) == 1) {
+    char fen[128];
+    unpack_board(&board, fen);
+    const i32 result = board.result < 3 ? board.result : 1;
+    if (epd) {
+      fprintf(output, "%s ce %i; c9 \"%s\";\n", fen,
+              board.stm_ep >> 7 ? -board.score : board.score,
+              results[result][1]);
+    } else {
+      fprintf(output, "%s %i %i | %i | %s\n", fen, board.halfmove,
+              board.fullmove, board.score, results[result][0]);
     }
+  }
+  fclose(input);
+  if (output != stdout) {
+    fclose(output);
+  }
+}
 
-    Position npos = *pos;
-#ifdef FULL
-    (*nodes)++;
-#endif
-    if (!makemove(&npos, &stack[ply].moves[move_index])) {
-      continue;
+// Texel tuning of the evaluation tables on positions labelled with game
+// results. The eval is linear in its parameters, so each position is kept as
+// the sparse difference between the feature counts of white and black, and
+// the parameters are fitted by full batch gradient descent with Adam to the
+// mean squared error of the eval's sigmoid, after fitting the sigmoid's scale.
+enum {
+  tune_material = 0,
+  tune_pst_rank = tune_material + 6,
+  tune_pst_file = tune_pst_rank + 48,
+  tune_open_files = tune_pst_file + 48,
+  tune_bishop_pair = tune_open_files + 6,
+  tune_params = tune_bishop_pair + 1,
+  tune_tempo = 16 // The constant eval() starts from
+};
+
+typedef struct [[nodiscard]] {
+  u8 index;
+  i8 coefficient;
+} TuneFeature;
+
+typedef struct [[nodiscard]] {
+  u32 start; // First feature in tune_features
+  u8 count;
+  i8 side; // 1 with white to move, -1 with black
+  float result; // From white's point of view
+} TunePosition;
+
+typedef struct [[nodiscard]] {
+  i32 begin;
+  i32 end;
+  bool gradient;
+  double loss;
+  double gradient_sum[tune_params];
+} TuneSlice;
+
+static TunePosition *tune_positions;
+static TuneFeature *tune_features;
+static i32 tune_count;
+static size_t tune_features_count;
+static double tune_weights[tune_params];
+static double tune_k;
+
+// Result from a c9 "1-0" style opcode, a "[1.0]" suffix or a last "| 1.0"
+// field
+[[nodiscard]] static bool parse_result(const char *const line,
+                                       float *const result) {
+  if (strstr(line, "1/2-1/2")) {
+    *result = 0.5f;
+  } else if (strstr(line, "1-0")) {
+    *result = 1.0f;
+  } else if (strstr(line, "0-1")) {
+    *result = 0.0f;
+  } else if (strrchr(line, '[')) {
+    *result = atof(strrchr(line, '[') + 1);
+  } else if (strrchr(line, '|')) {
+    *result = atof(strrchr(line, '|') + 1);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Adds the eval features of one position, counted for white and against
+// black exactly as eval() scores them
+static void tune_add_position(Position *const pos, const float result) {
+  i32 coefficients[tune_params] = {0};
+  const i8 side = pos->flipped ? -1 : 1;
+  if (pos->flipped) {
+    flip_pos(pos);
+  }
+  for (i32 c = 0; c < 2; c++) {
+    const i32 sign = c ? -1 : 1;
+    coefficients[tune_bishop_pair] +=
+        sign * (count(pos->colour[0] & pos->pieces[Bishop]) > 1);
+    const u64 own_pawns = pos->colour[0] & pos->pieces[Pawn];
+    for (i32 p = Pawn; p <= King; p++) {
+      for (u64 bb = pos->colour[0] & pos->pieces[p]; bb; bb &= bb - 1) {
+        const i32 sq = lsb(bb);
+        coefficients[tune_open_files + p - 1] +=
+            sign * ((north(0x101010101010101ULL << sq) & own_pawns) == 0);
+        coefficients[tune_material + p - 1] += sign;
+        coefficients[tune_pst_rank + (p - 1) * 8 + (sq >> 3)] += sign;
+        coefficients[tune_pst_file + (p - 1) * 8 + (sq & 7)] += sign;
+      }
     }
+    flip_pos(pos);
+  }
 
-    // PRINCIPAL VARIATION SEARCH
-    i32 low = moves_evaluated == 0 ? -beta : -alpha - 1;
-    moves_evaluated++;
+  static size_t positions_capacity;
+  static size_t features_capacity;
+  if (tune_count == (i32)positions_capacity) {
+    positions_capacity = positions_capacity ? 2 * positions_capacity : 1 << 16;
+    tune_positions =
+        realloc(tune_positions, positions_capacity * sizeof(TunePosition));
+  }
+  if (tune_features_count + tune_params > features_capacity) {
+    features_capacity = features_capacity ? 2 * features_capacity : 1 << 22;
+    tune_features =
+        realloc(tune_features, features_capacity * sizeof(TuneFeature));
+  }
 
-    // LATE MOVE REDCUCTION
-    i32 reduction =
-        depth > 1 && moves_evaluated > 6 ? 2 + moves_evaluated / 13 : 1;
+  TunePosition *const position = &tune_positions[tune_count++];
+  *position = (TunePosition){
+      .start = tune_features_count, .side = side, .result = result};
+  for (i32 i = 0; i < tune_params; i++) {
+    if (coefficients[i]) {
+      tune_features[tune_features_count++] =
+          (TuneFeature){.index = i, .coefficient = coefficients[i]};
+      position->count++;
+    }
+  }
+}
 
-    i32 score;
-    while (true) {
-      score = -search(&npos, ply + 1, depth - reduction, low, -alpha,
-#ifdef FULL
-                      nodes,
-#endif
-                      stack, pos_history_count, true);
+static void *tune_slice(void *const arg) {
+  TuneSlice *const slice = arg;
+  const double scale = tune_k / 400;
+  slice->loss = 0;
+  __builtin_memset(slice->gradient_sum, 0, sizeof slice->gradient_sum);
+  for (i32 i = slice->begin; i < slice->end; i++) {
+    const TunePosition *const position = &tune_positions[i];
+    const TuneFeature *const features = tune_features + position->start;
+    double eval = tune_tempo * position->side;
+    for (i32 j = 0; j < position->count; j++) {
+      eval += tune_weights[features[j].index] * features[j].coefficient;
+    }
+    const double sigmoid = 1 / (1 + exp(-scale * eval));
+    const double error = sigmoid - position->result;
+    slice->loss += error * error;
+    if (slice->gradient) {
+      // The constant factors are left to the step size
+      const double gradient = error * sigmoid * (1 - sigmoid);
+      for (i32 j = 0; j < position->count; j++) {
+        slice->gradient_sum[features[j].index] +=
+            gradient * features[j].coefficient;
+      }
+    }
+  }
+  return NULL;
+}
 
-      if (score <= alpha || (low == -beta && reduction == 1)) {
-        break;
+// Mean loss over all positions, and its gradient if asked, split over the
+// threads by contiguous ranges of positions
+static double tune_pass(double *const gradient) {
+  static TuneSlice slices[max_threads];
+  pthread_t workers[max_threads];
+  for (i32 i = 0; i < num_threads; i++) {
+    slices[i].begin = (i64)tune_count * i / num_threads;
+    slices[i].end = (i64)tune_count * (i + 1) / num_threads;
+    slices[i].gradient = gradient;
+    if (i) {
+      pthread_create(&workers[i], NULL, tune_slice, &slices[i]);
+    }
+  }
+  tune_slice(&slices[0]);
+  double loss = slices[0].loss;
+  for (i32 i = 1; i < num_threads; i++) {
+    pthread_join(workers[i], NULL);
+    loss += slices[i].loss;
+  }
+  if (gradient) {
+    for (i32 p = 0; p < tune_params; p++) {
+      gradient[p] = 0;
+      for (i32 i = 0; i < num_threads; i++) {
+        gradient[p] += slices[i].gradient_sum[p];
       }
+    }
+  }
+  return loss / tune_count;
+}
 
-      low = -beta;
-      reduction = 1;
+static void print_tune_table(const char *const declaration, const i32 start,
+                             const i32 length, const bool rows) {
+  static const char *const names[6] = {"Pawn",  "Knight", "Bishop",
+                                       "Rook",  "Queen",  "King"};
+  printf("%s = {", declaration);
+  for (i32 i = 0; i < length; i++) {
+    i32 value = round(tune_weights[start + i]);
+    if (strstr(declaration, "i8")) {
+      value = value < -128 ? -128 : value > 127 ? 127 : value;
+    }
+    if (rows) {
+      printf("%s%i,%s%s", i % 8 ? " " : "\n    ", value,
+             i % 8 == 7 ? " // " : "", i % 8 == 7 ? names[i / 8] : "");
+    } else {
+      printf("%s%i", i ? ", " : "", value);
     }
+  }
+  printf(rows ? "\n};\n" : "};\n");
+}
 
-    if (score > best_score) {
-      best_score = score;
+// 4kc tune positions.epd [--threads n] [--epochs n] [--lr x] [--k x]
+static void tune(const i32 argc, char **const argv) {
+  i32 epochs = 500;
+  double rate = 1.0;
+  tune_k = 0;
+  for (i32 i = 3; i + 1 < argc; i += 2) {
+    const i32 value = atoi(argv[i + 1]);
+    if (!strcmp(argv[i], "--threads")) {
+      num_threads = value < 1             ? 1
+                    : value > max_threads ? max_threads
+                                          : value;
+    } else if (!strcmp(argv[i], "--epochs")) {
+      epochs = value;
+    } else if (!strcmp(argv[i], "--lr")) {
+      rate = atof(argv[i + 1]);
+    } else if (!strcmp(argv[i], "--k")) {
+      tune_k = atof(argv[i + 1]);
     }
+  }
 
-    if (score > alpha) {
-      stack[ply].best_move = stack[ply].moves[move_index];
-      alpha = score;
-      tt_flag = Exact;
-      if (score >= beta) {
-        tt_flag = Lower;
-        assert(stack[ply].best_move.takes_piece ==
-               piece_on(pos, stack[ply].best_move.to));
-        i32 *const this_hist =
-            &move_history[pos->flipped][stack[ply].best_move.takes_piece]
-                         [stack[ply].best_move.from][stack[ply].best_move.to];
-        *this_hist += depth * depth - depth * depth * *this_hist / 1024;
-        for (i32 prev_index = 0; prev_index < move_index; prev_index++) {
-          const Move prev = stack[ply].moves[prev_index];
-          i32 *const prev_hist =
-              &move_history[pos->flipped][prev.takes_piece][prev.from][prev.to];
-          *prev_hist -= depth * depth + depth * depth * *prev_hist / 1024;
-        }
-        if (stack[ply].best_move.takes_piece == None) {
-          stack[ply].killer = stack[ply].best_move;
-        }
-        break;
+  FILE *const input = fopen(argv[2], "r");
+  if (!input) {
+    fprintf(stderr, "Cannot open %s\n", argv[2]);
+    return;
+  }
+  char line[4096];
+  while (fgets(line, sizeof line, input)) {
+    float result;
+    if (line[0] == '#' || !parse_result(line, &result)) {
+      continue;
+    }
+    Position pos;
+    set_fen(&pos, line);
+    tune_add_position(&pos, result);
+  }
+  fclose(input);
+  if (!tune_count) {
+    fprintf(stderr, "No labelled positions in %s\n", argv[2]);
+    return;
+  }
+  printf("info string positions %i features %zu\n", tune_count,
+         tune_features_count);
+
+  for (i32 p = Pawn; p <= King; p++) {
+    tune_weights[tune_material + p - 1] = material[p - 1];
+    tune_weights[tune_open_files + p - 1] = open_files[p - 1];
+  }
+  for (i32 i = 0; i < 48; i++) {
+    tune_weights[tune_pst_rank + i] = pst_rank[i];
+    tune_weights[tune_pst_file + i] = pst_file[i];
+  }
+  tune_weights[tune_bishop_pair] = bishop_pair;
+
+  // The scale that best fits the current tables, by golden section search
+  if (!tune_k) {
+    double low = 0.05;
+    double high = 5;
+    for (i32 i = 0; i < 40; i++) {
+      const double third = (high - low) * 0.381966;
+      tune_k = low + third;
+      const double loss_low = tune_pass(NULL);
+      tune_k = high - third;
+      if (loss_low < tune_pass(NULL)) {
+        high -= third;
+      } else {
+        low += third;
+      }
+    }
+    tune_k = (low + high) / 2;
+  }
+  printf("info string K %f loss %f\n", tune_k, tune_pass(NULL));
+
+  static double gradient[tune_params];
+  static double momentum[tune_params];
+  static double velocity[tune_params];
+  const u64 start = get_time();
+  for (i32 epoch = 1; epoch <= epochs; epoch++) {
+    const double loss = tune_pass(gradient);
+    for (i32 p = 0; p < tune_params; p++) {
+      momentum[p] = 0.9 * momentum[p] + 0.1 * gradient[p];
+      velocity[p] = 0.999 * velocity[p] + 0.001 * gradient[p] * gradient[p];
+      const double corrected_momentum = momentum[p] / (1 - pow(0.9, epoch));
+      const double corrected_velocity =
+          velocity[p] / (1 - pow(0.999, epoch));
+      tune_weights[p] -=
+          rate * corrected_momentum / (sqrt(corrected_velocity) + 1e-12);
+    }
+    if (epoch % 25 == 0 || epoch == epochs) {
+      printf("info string epoch %i loss %f time %llu\n", epoch, loss,
+             get_time() - start);
+    }
+  }
+
+  print_tune_table(
+      "__attribute__((aligned(8))) static const i16 material[]",
+      tune_material, 6, false);
+  print_tune_table("__attribute__((aligned(8))) static const i8 pst_rank[]",
+                   tune_pst_rank, 48, true);
+  print_tune_table("__attribute__((aligned(8))) static const i8 pst_file[]",
+                   tune_pst_file, 48, true);
+  print_tune_table(
+      "__attribute__((aligned(8))) static const i8 open_files[]",
+      tune_open_files, 6, false);
+  i32 value = round(tune_weights[tune_bishop_pair]);
+  value = value < -128 ? -128 : value > 127 ? 127 : value;
+  printf("const i8 bishop_pair = %i;\n", value);
+  free(tune_positions);
+  free(tune_features);
+}
+#endif
+#endif
+
+#ifdef HOSTED
+static void load_eval_file(const char *const path) {
+  static u8 buffer[nnue_file_size];
+  FILE *const file = fopen(path, "rb");
+  const size_t size = file ? fread(buffer, 1, sizeof buffer, file) : 0;
+  if (file) {
+    fclose(file);
+  }
+  if (nnue_load(buffer, size)) {
+    printf("info string Loaded network %s\n", path);
+  } else {
+    printf("info string Network %s unavailable\n", path);
+  }
+}
+
+// Polyglot opening book, memory mapped and binary searched in place. Entries
+// are 16 big endian bytes sorted by key: key, move, weight and learn data.
+typedef struct [[nodiscard]] {
+  u64 key;
+  u16 move;
+  u16 weight;
+  u32 learn;
+} BookEntry;
+
+static const BookEntry *book;
+static size_t book_length;
+static bool own_book;
+static bool book_best_move;
+static u64 book_seed;
+
+// Random numbers of the Polyglot key: 12 pieces on 64 squares, 4 castling
+// rights, 8 en passant files and the side to move
+static const u64 polyglot_randoms[781] = {
+    0x9D39247E33776D41ull, 0x2AF7398005AAA5C7ull, 0x44DB015024623547ull,
+    0x9C15F73E62A76AE2ull, 0x75834465489C0C89ull, 0x3290AC3A203001BFull,
+    0x0FBBAD1F61042279ull, 0xE83A908FF2FB60CAull, 0x0D7E765D58755C10ull,
+    0x1A083822CEAFE02Dull, 0x9605D5F0E25EC3B0ull, 0xD021FF5CD13A2ED5ull,
+    0x40BDF15D4A672E32ull, 0x011355146FD56395ull, 0x5DB4832046F3D9E5ull,
+    0x239F8B2D7FF719CCull, 0x05D1A1AE85B49AA1ull, 0x679F848F6E8FC971ull,
+    0x7449BBFF801FED0Bull, 0x7D11CDB1C3B7ADF0ull, 0x82C7709E781EB7CCull,
+    0xF3218F1C9510786Cull, 0x331478F3AF51BBE6ull, 0x4BB38DE5E7219443ull,
+    0xAA649C6EBCFD50FCull, 0x8DBD98A352AFD40Bull, 0x87D2074B81D79217ull,
+    0x19F3C751D3E92AE1ull, 0xB4AB30F062B19ABFull, 0x7B0500AC42047AC4ull,
+    0xC9452CA81A09D85Dull, 0x24AA6C514DA27500ull, 0x4C9F34427501B447ull,
+    0x14A68FD73C910841ull, 0xA71B9B83461CBD93ull, 0x03488B95B0F1850Full,
+    0x637B2B34FF93C040ull, 0x09D1BC9A3DD90A94ull, 0x3575668334A1DD3Bull,
+    0x735E2B97A4C45A23ull, 0x18727070F1BD400Bull, 0x1FCBACD259BF02E7ull,
+    0xD310A7C2CE9B6555ull, 0xBF983FE0FE5D8244ull, 0x9F74D14F7454A824ull,
+    0x51EBDC4AB9BA3035ull, 0x5C82C505DB9AB0FAull, 0xFCF7FE8A3430B241ull,
+    0x3253A729B9BA3DDEull, 0x8C74C368081B3075ull, 0xB9BC6C87167C33E7ull,
+    0x7EF48F2B83024E20ull, 0x11D505D4C351BD7Full, 0x6568FCA92C76A243ull,
+    0x4DE0B0F40F32A7B8ull, 0x96D693460CC37E5Dull, 0x42E240CB63689F2Full,
+    0x6D2BDCDAE2919661ull, 0x42880B0236E4D951ull, 0x5F0F4A5898171BB6ull,
+    0x39F890F579F92F88ull, 0x93C5B5F47356388Bull, 0x63DC359D8D231B78ull,
+    0xEC16CA8AEA98AD76ull, 0x5355F900C2A82DC7ull, 0x07FB9F855A997142ull,
+    0x5093417AA8A7ED5Eull, 0x7BCBC38DA25A7F3Cull, 0x19FC8A768CF4B6D4ull,
+    0x637A7780DECFC0D9ull, 0x8249A47AEE0E41F7ull, 0x79AD695501E7D1E8ull,
+    0x14ACBAF4777D5776ull, 0xF145B6BECCDEA195ull, 0xDABF2AC8201752FCull,
+    0x24C3C94DF9C8D3F6ull, 0xBB6E2924F03912EAull, 0x0CE26C0B95C980D9ull,
+    0xA49CD132BFBF7CC4ull, 0xE99D662AF4243939ull, 0x27E6AD7891165C3Full,
+    0x8535F040B9744FF1ull, 0x54B3F4FA5F40D873ull, 0x72B12C32127FED2Bull,
+    0xEE954D3C7B411F47ull, 0x9A85AC909A24EAA1ull, 0x70AC4CD9F04F21F5ull,
+    0xF9B89D3E99A075C2ull, 0x87B3E2B2B5C907B1ull, 0xA366E5B8C54F48B8ull,
+    0xAE4A9346CC3F7CF2ull, 0x1920C04D47267BBDull, 0x87BF02C6B49E2AE9ull,
+    0x092237AC237F3859ull, 0xFF07F64EF8ED14D0ull, 0x8DE8DCA9F03CC54Eull,
+    0x9C1633264DB49C89ull, 0xB3F22C3D0B0B38EDull, 0x390E5FB44D01144Bull,
+    0x5BFEA5B4712768E9ull, 0x1E1032911FA78984ull, 0x9A74ACB964E78CB3ull,
+    0x4F80F7A035DAFB04ull, 0x6304D09A0B3738C4ull, 0x2171E64683023A08ull,
+    0x5B9B63EB9CEFF80Cull, 0x506AACF489889342ull, 0x1881AFC9A3A701D6ull,
+    0x6503080440750644ull, 0xDFD395339CDBF4A7ull, 0xEF927DBCF00C20F2ull,
+    0x7B32F7D1E03680ECull, 0xB9FD7620E7316243ull, 0x05A7E8A57DB91B77ull,
+    0xB5889C6E15630A75ull, 0x4A750A09CE9573F7ull, 0xCF464CEC899A2F8Aull,
+    0xF538639CE705B824ull, 0x3C79A0FF5580EF7Full, 0xEDE6C87F8477609Dull,
+    0x799E81F05BC93F31ull, 0x86536B8CF3428A8Cull, 0x97D7374C60087B73ull,
+    0xA246637CFF328532ull, 0x043FCAE60CC0EBA0ull, 0x920E449535DD359Eull,
+    0x70EB093B15B290CCull, 0x73A1921916591CBDull, 0x56436C9FE1A1AA8Dull,
+    0xEFAC4B70633B8F81ull, 0xBB215798D45DF7AFull, 0x45F20042F24F1768ull,
+    0x930F80F4E8EB7462ull, 0xFF6712FFCFD75EA1ull, 0xAE623FD67468AA70ull,
+    0xDD2C5BC84BC8D8FCull, 0x7EED120D54CF2DD9ull, 0x22FE545401165F1Cull,
+    0xC91800E98FB99929ull, 0x808BD68E6AC10365ull, 0xDEC468145B7605F6ull,
+    0x1BEDE3A3AEF53302ull, 0x43539603D6C55602ull, 0xAA969B5C691CCB7Aull,
+    0xA87832D392EFEE56ull, 0x65942C7B3C7E11AEull, 0xDED2D633CAD004F6ull,
+    0x21F08570F420E565ull, 0xB415938D7DA94E3Cull, 0x91B859E59ECB6350ull,
+    0x10CFF333E0ED804Aull, 0x28AED140BE0BB7DDull, 0xC5CC1D89724FA456ull,
+    0x5648F680F11A2741ull, 0x2D255069F0B7DAB3ull, 0x9BC5A38EF729ABD4ull,
+    0xEF2F054308F6A2BCull, 0xAF2042F5CC5C2858ull, 0x480412BAB7F5BE2Aull,
+    0xAEF3AF4A563DFE43ull, 0x19AFE59AE451497Full, 0x52593803DFF1E840ull,
+    0xF4F076E65F2CE6F0ull, 0x11379625747D5AF3ull, 0xBCE5D2248682C115ull,
+    0x9DA4243DE836994Full, 0x066F70B33FE09017ull, 0x4DC4DE189B671A1Cull,
+    0x51039AB7712457C3ull, 0xC07A3F80C31FB4B4ull, 0xB46EE9C5E64A6E7Cull,
+    0xB3819A42ABE61C87ull, 0x21A007933A522A20ull, 0x2DF16F761598AA4Full,
+    0x763C4A1371B368FDull, 0xF793C46702E086A0ull, 0xD7288E012AEB8D31ull,
+    0xDE336A2A4BC1C44Bull, 0x0BF692B38D079F23ull, 0x2C604A7A177326B3ull,
+    0x4850E73E03EB6064ull, 0xCFC447F1E53C8E1Bull, 0xB05CA3F564268D99ull,
+    0x9AE182C8BC9474E8ull, 0xA4FC4BD4FC5558CAull, 0xE755178D58FC4E76ull,
+    0x69B97DB1A4C03DFEull, 0xF9B5B7C4ACC67C96ull, 0xFC6A82D64B8655FBull,
+    0x9C684CB6C4D24417ull, 0x8EC97D2917456ED0ull, 0x6703DF9D2924E97Eull,
+    0xC547F57E42A7444Eull, 0x78E37644E7CAD29Eull, 0xFE9A44E9362F05FAull,
+    0x08BD35CC38336615ull, 0x9315E5EB3A129ACEull, 0x94061B871E04DF75ull,
+    0xDF1D9F9D784BA010ull, 0x3BBA57B68871B59Dull, 0xD2B7ADEEDED1F73Full,
+    0xF7A255D83BC373F8ull, 0xD7F4F2448C0CEB81ull, 0xD95BE88CD210FFA7ull,
+    0x336F52F8FF4728E7ull, 0xA74049DAC312AC71ull, 0xA2F61BB6E437FDB5ull,
+    0x4F2A5CB07F6A35B3ull, 0x87D380BDA5BF7859ull, 0x16B9F7E06C453A21ull,
+    0x7BA2484C8A0FD54Eull, 0xF3A678CAD9A2E38Cull, 0x39B0BF7DDE437BA2ull,
+    0xFCAF55C1BF8A4424ull, 0x18FCF680573FA594ull, 0x4C0563B89F495AC3ull,
+    0x40E087931A00930Dull, 0x8CFFA9412EB642C1ull, 0x68CA39053261169Full,
+    0x7A1EE967D27579E2ull, 0x9D1D60E5076F5B6Full, 0x3810E399B6F65BA2ull,
+    0x32095B6D4AB5F9B1ull, 0x35CAB62109DD038Aull, 0xA90B24499FCFAFB1ull,
+    0x77A225A07CC2C6BDull, 0x513E5E634C70E331ull, 0x4361C0CA3F692F12ull,
+    0xD941ACA44B20A45Bull, 0x528F7C8602C5807Bull, 0x52AB92BEB9613989ull,
+    0x9D1DFA2EFC557F73ull, 0x722FF175F572C348ull, 0x1D1260A51107FE97ull,
+    0x7A249A57EC0C9BA2ull, 0x04208FE9E8F7F2D6ull, 0x5A110C6058B920A0ull,
+    0x0CD9A497658A5698ull, 0x56FD23C8F9715A4Cull, 0x284C847B9D887AAEull,
+    0x04FEABFBBDB619CBull, 0x742E1E651C60BA83ull, 0x9A9632E65904AD3Cull,
+    0x881B82A13B51B9E2ull, 0x506E6744CD974924ull, 0xB0183DB56FFC6A79ull,
+    0x0ED9B915C66ED37Eull, 0x5E11E86D5873D484ull, 0xF678647E3519AC6Eull,
+    0x1B85D488D0F20CC5ull, 0xDAB9FE6525D89021ull, 0x0D151D86ADB73615ull,
+    0xA865A54EDCC0F019ull, 0x93C42566AEF98FFBull, 0x99E7AFEABE000731ull,
+    0x48CBFF086DDF285Aull, 0x7F9B6AF1EBF78BAFull, 0x58627E1A149BBA21ull,
+    0x2CD16E2ABD791E33ull, 0xD363EFF5F0977996ull, 0x0CE2A38C344A6EEDull,
+    0x1A804AADB9CFA741ull, 0x907F30421D78C5DEull, 0x501F65EDB3034D07ull,
+    0x37624AE5A48FA6E9ull, 0x957BAF61700CFF4Eull, 0x3A6C27934E31188Aull,
+    0xD49503536ABCA345ull, 0x088E049589C432E0ull, 0xF943AEE7FEBF21B8ull,
+    0x6C3B8E3E336139D3ull, 0x364F6FFA464EE52Eull, 0xD60F6DCEDC314222ull,
+    0x56963B0DCA418FC0ull, 0x16F50EDF91E513AFull, 0xEF1955914B609F93ull,
+    0x565601C0364E3228ull, 0xECB53939887E8175ull, 0xBAC7A9A18531294Bull,
+    0xB344C470397BBA52ull, 0x65D34954DAF3CEBDull, 0xB4B81B3FA97511E2ull,
+    0xB422061193D6F6A7ull, 0x071582401C38434Dull, 0x7A13F18BBEDC4FF5ull,
+    0xBC4097B116C524D2ull, 0x59B97885E2F2EA28ull, 0x99170A5DC3115544ull,
+    0x6F423357E7C6A9F9ull, 0x325928EE6E6F8794ull, 0xD0E4366228B03343ull,
+    0x565C31F7DE89EA27ull, 0x30F5611484119414ull, 0xD873DB391292ED4Full,
+    0x7BD94E1D8E17DEBCull, 0xC7D9F16864A76E94ull, 0x947AE053EE56E63Cull,
+    0xC8C93882F9475F5Full, 0x3A9BF55BA91F81CAull, 0xD9A11FBB3D9808E4ull,
+    0x0FD22063EDC29FCAull, 0xB3F256D8ACA0B0B9ull, 0xB03031A8B4516E84ull,
+    0x35DD37D5871448AFull, 0xE9F6082B05542E4Eull, 0xEBFAFA33D7254B59ull,
+    0x9255ABB50D532280ull, 0xB9AB4CE57F2D34F3ull, 0x693501D628297551ull,
+    0xC62C58F97DD949BFull, 0xCD454F8F19C5126Aull, 0xBBE83F4ECC2BDECBull,
+    0xDC842B7E2819E230ull, 0xBA89142E007503B8ull, 0xA3BC941D0A5061CBull,
+    0xE9F6760E32CD8021ull, 0x09C7E552BC76492Full, 0x852F54934DA55CC9ull,
+    0x8107FCCF064FCF56ull, 0x098954D51FFF6580ull, 0x23B70EDB1955C4BFull,
+    0xC330DE426430F69Dull, 0x4715ED43E8A45C0Aull, 0xA8D7E4DAB780A08Dull,
+    0x0572B974F03CE0BBull, 0xB57D2E985E1419C7ull, 0xE8D9ECBE2CF3D73Full,
+    0x2FE4B17170E59750ull, 0x11317BA87905E790ull, 0x7FBF21EC8A1F45ECull,
+    0x1725CABFCB045B00ull, 0x964E915CD5E2B207ull, 0x3E2B8BCBF016D66Dull,
+    0xBE7444E39328A0ACull, 0xF85B2B4FBCDE44B7ull, 0x49353FEA39BA63B1ull,
+    0x1DD01AAFCD53486Aull, 0x1FCA8A92FD719F85ull, 0xFC7C95D827357AFAull,
+    0x18A6A990C8B35EBDull, 0xCCCB7005C6B9C28Dull, 0x3BDBB92C43B17F26ull,
+    0xAA70B5B4F89695A2ull, 0xE94C39A54A98307Full, 0xB7A0B174CFF6F36Eull,
+    0xD4DBA84729AF48ADull, 0x2E18BC1AD9704A68ull, 0x2DE0966DAF2F8B1Cull,
+    0xB9C11D5B1E43A07Eull, 0x64972D68DEE33360ull, 0x94628D38D0C20584ull,
+    0xDBC0D2B6AB90A559ull, 0xD2733C4335C6A72Full, 0x7E75D99D94A70F4Dull,
+    0x6CED1983376FA72Bull, 0x97FCAACBF030BC24ull, 0x7B77497B32503B12ull,
+    0x8547EDDFB81CCB94ull, 0x79999CDFF70902CBull, 0xCFFE1939438E9B24ull,
+    0x829626E3892D95D7ull, 0x92FAE24291F2B3F1ull, 0x63E22C147B9C3403ull,
+    0xC678B6D860284A1Cull, 0x5873888850659AE7ull, 0x0981DCD296A8736Dull,
+    0x9F65789A6509A440ull, 0x9FF38FED72E9052Full, 0xE479EE5B9930578Cull,
+    0xE7F28ECD2D49EECDull, 0x56C074A581EA17FEull, 0x5544F7D774B14AEFull,
+    0x7B3F0195FC6F290Full, 0x12153635B2C0CF57ull, 0x7F5126DBBA5E0CA7ull,
+    0x7A76956C3EAFB413ull, 0x3D5774A11D31AB39ull, 0x8A1B083821F40CB4ull,
+    0x7B4A38E32537DF62ull, 0x950113646D1D6E03ull, 0x4DA8979A0041E8A9ull,
+    0x3BC36E078F7515D7ull, 0x5D0A12F27AD310D1ull, 0x7F9D1A2E1EBE1327ull,
+    0xDA3A361B1C5157B1ull, 0xDCDD7D20903D0C25ull, 0x36833336D068F707ull,
+    0xCE68341F79893389ull, 0xAB9090168DD05F34ull, 0x43954B3252DC25E5ull,
+    0xB438C2B67F98E5E9ull, 0x10DCD78E3851A492ull, 0xDBC27AB5447822BFull,
+    0x9B3CDB65F82CA382ull, 0xB67B7896167B4C84ull, 0xBFCED1B0048EAC50ull,
+    0xA9119B60369FFEBDull, 0x1FFF7AC80904BF45ull, 0xAC12FB171817EEE7ull,
+    0xAF08DA9177DDA93Dull, 0x1B0CAB936E65C744ull, 0xB559EB1D04E5E932ull,
+    0xC37B45B3F8D6F2BAull, 0xC3A9DC228CAAC9E9ull, 0xF3B8B6675A6507FFull,
+    0x9FC477DE4ED681DAull, 0x67378D8ECCEF96CBull, 0x6DD856D94D259236ull,
+    0xA319CE15B0B4DB31ull, 0x073973751F12DD5Eull, 0x8A8E849EB32781A5ull,
+    0xE1925C71285279F5ull, 0x74C04BF1790C0EFEull, 0x4DDA48153C94938Aull,
+    0x9D266D6A1CC0542Cull, 0x7440FB816508C4FEull, 0x13328503DF48229Full,
+    0xD6BF7BAEE43CAC40ull, 0x4838D65F6EF6748Full, 0x1E152328F3318DEAull,
+    0x8F8419A348F296BFull, 0x72C8834A5957B511ull, 0xD7A023A73260B45Cull,
+    0x94EBC8ABCFB56DAEull, 0x9FC10D0F989993E0ull, 0xDE68A2355B93CAE6ull,
+    0xA44CFE79AE538BBEull, 0x9D1D84FCCE371425ull, 0x51D2B1AB2DDFB636ull,
+    0x2FD7E4B9E72CD38Cull, 0x65CA5B96B7552210ull, 0xDD69A0D8AB3B546Dull,
+    0x604D51B25FBF70E2ull, 0x73AA8A564FB7AC9Eull, 0x1A8C1E992B941148ull,
+    0xAAC40A2703D9BEA0ull, 0x764DBEAE7FA4F3A6ull, 0x1E99B96E70A9BE8Bull,
+    0x2C5E9DEB57EF4743ull, 0x3A938FEE32D29981ull, 0x26E6DB8FFDF5ADFEull,
+    0x469356C504EC9F9Dull, 0xC8763C5B08D1908Cull, 0x3F6C6AF859D80055ull,
+    0x7F7CC39420A3A545ull, 0x9BFB227EBDF4C5CEull, 0x89039D79D6FC5C5Cull,
+    0x8FE88B57305E2AB6ull, 0xA09E8C8C35AB96DEull, 0xFA7E393983325753ull,
+    0xD6B6D0ECC617C699ull, 0xDFEA21EA9E7557E3ull, 0xB67C1FA481680AF8ull,
+    0xCA1E3785A9E724E5ull, 0x1CFC8BED0D681639ull, 0xD18D8549D140CAEAull,
+    0x4ED0FE7E9DC91335ull, 0xE4DBF0634473F5D2ull, 0x1761F93A44D5AEFEull,
+    0x53898E4C3910DA55ull, 0x734DE8181F6EC39Aull, 0x2680B122BAA28D97ull,
+    0x298AF231C85BAFABull, 0x7983EED3740847D5ull, 0x66C1A2A1A60CD889ull,
+    0x9E17E49642A3E4C1ull, 0xEDB454E7BADC0805ull, 0x50B704CAB602C329ull,
+    0x4CC317FB9CDDD023ull, 0x66B4835D9EAFEA22ull, 0x219B97E26FFC81BDull,
+    0x261E4E4C0A333A9Dull, 0x1FE2CCA76517DB90ull, 0xD7504DFA8816EDBBull,
+    0xB9571FA04DC089C8ull, 0x1DDC0325259B27DEull, 0xCF3F4688801EB9AAull,
+    0xF4F5D05C10CAB243ull, 0x38B6525C21A42B0Eull, 0x36F60E2BA4FA6800ull,
+    0xEB3593803173E0CEull, 0x9C4CD6257C5A3603ull, 0xAF0C317D32ADAA8Aull,
+    0x258E5A80C7204C4Bull, 0x8B889D624D44885Dull, 0xF4D14597E660F855ull,
+    0xD4347F66EC8941C3ull, 0xE699ED85B0DFB40Dull, 0x2472F6207C2D0484ull,
+    0xC2A1E7B5B459AEB5ull, 0xAB4F6451CC1D45ECull, 0x63767572AE3D6174ull,
+    0xA59E0BD101731A28ull, 0x116D0016CB948F09ull, 0x2CF9C8CA052F6E9Full,
+    0x0B090A7560A968E3ull, 0xABEEDDB2DDE06FF1ull, 0x58EFC10B06A2068Dull,
+    0xC6E57A78FBD986E0ull, 0x2EAB8CA63CE802D7ull, 0x14A195640116F336ull,
+    0x7C0828DD624EC390ull, 0xD74BBE77E6116AC7ull, 0x804456AF10F5FB53ull,
+    0xEBE9EA2ADF4321C7ull, 0x03219A39EE587A30ull, 0x49787FEF17AF9924ull,
+    0xA1E9300CD8520548ull, 0x5B45E522E4B1B4EFull, 0xB49C3B3995091A36ull,
+    0xD4490AD526F14431ull, 0x12A8F216AF9418C2ull, 0x001F837CC7350524ull,
+    0x1877B51E57A764D5ull, 0xA2853B80F17F58EEull, 0x993E1DE72D36D310ull,
+    0xB3598080CE64A656ull, 0x252F59CF0D9F04BBull, 0xD23C8E176D113600ull,
+    0x1BDA0492E7E4586Eull, 0x21E0BD5026C619BFull, 0x3B097ADAF088F94Eull,
+    0x8D14DEDB30BE846Eull, 0xF95CFFA23AF5F6F4ull, 0x3871700761B3F743ull,
+    0xCA672B91E9E4FA16ull, 0x64C8E531BFF53B55ull, 0x241260ED4AD1E87Dull,
+    0x106C09B972D2E822ull, 0x7FBA195410E5CA30ull, 0x7884D9BC6CB569D8ull,
+    0x0647DFEDCD894A29ull, 0x63573FF03E224774ull, 0x4FC8E9560F91B123ull,
+    0x1DB956E450275779ull, 0xB8D91274B9E9D4FBull, 0xA2EBEE47E2FBFCE1ull,
+    0xD9F1F30CCD97FB09ull, 0xEFED53D75FD64E6Bull, 0x2E6D02C36017F67Full,
+    0xA9AA4D20DB084E9Bull, 0xB64BE8D8B25396C1ull, 0x70CB6AF7C2D5BCF0ull,
+    0x98F076A4F7A2322Eull, 0xBF84470805E69B5Full, 0x94C3251F06F90CF3ull,
+    0x3E003E616A6591E9ull, 0xB925A6CD0421AFF3ull, 0x61BDD1307C66E300ull,
+    0xBF8D5108E27E0D48ull, 0x240AB57A8B888B20ull, 0xFC87614BAF287E07ull,
+    0xEF02CDD06FFDB432ull, 0xA1082C0466DF6C0Aull, 0x8215E577001332C8ull,
+    0xD39BB9C3A48DB6CFull, 0x2738259634305C14ull, 0x61CF4F94C97DF93Dull,
+    0x1B6BACA2AE4E125Bull, 0x758F450C88572E0Bull, 0x959F587D507A8359ull,
+    0xB063E962E045F54Dull, 0x60E8ED72C0DFF5D1ull, 0x7B64978555326F9Full,
+    0xFD080D236DA814BAull, 0x8C90FD9B083F4558ull, 0x106F72FE81E2C590ull,
+    0x7976033A39F7D952ull, 0xA4EC0132764CA04Bull, 0x733EA705FAE4FA77ull,
+    0xB4D8F77BC3E56167ull, 0x9E21F4F903B33FD9ull, 0x9D765E419FB69F6Dull,
+    0xD30C088BA61EA5EFull, 0x5D94337FBFAF7F5Bull, 0x1A4E4822EB4D7A59ull,
+    0x6FFE73E81B637FB3ull, 0xDDF957BC36D8B9CAull, 0x64D0E29EEA8838B3ull,
+    0x08DD9BDFD96B9F63ull, 0x087E79E5A57D1D13ull, 0xE328E230E3E2B3FBull,
+    0x1C2559E30F0946BEull, 0x720BF5F26F4D2EAAull, 0xB0774D261CC609DBull,
+    0x443F64EC5A371195ull, 0x4112CF68649A260Eull, 0xD813F2FAB7F5C5CAull,
+    0x660D3257380841EEull, 0x59AC2C7873F910A3ull, 0xE846963877671A17ull,
+    0x93B633ABFA3469F8ull, 0xC0C0F5A60EF4CDCFull, 0xCAF21ECD4377B28Cull,
+    0x57277707199B8175ull, 0x506C11B9D90E8B1Dull, 0xD83CC2687A19255Full,
+    0x4A29C6465A314CD1ull, 0xED2DF21216235097ull, 0xB5635C95FF7296E2ull,
+    0x22AF003AB672E811ull, 0x52E762596BF68235ull, 0x9AEBA33AC6ECC6B0ull,
+    0x944F6DE09134DFB6ull, 0x6C47BEC883A7DE39ull, 0x6AD047C430A12104ull,
+    0xA5B1CFDBA0AB4067ull, 0x7C45D833AFF07862ull, 0x5092EF950A16DA0Bull,
+    0x9338E69C052B8E7Bull, 0x455A4B4CFE30E3F5ull, 0x6B02E63195AD0CF8ull,
+    0x6B17B224BAD6BF27ull, 0xD1E0CCD25BB9C169ull, 0xDE0C89A556B9AE70ull,
+    0x50065E535A213CF6ull, 0x9C1169FA2777B874ull, 0x78EDEFD694AF1EEDull,
+    0x6DC93D9526A50E68ull, 0xEE97F453F06791EDull, 0x32AB0EDB696703D3ull,
+    0x3A6853C7E70757A7ull, 0x31865CED6120F37Dull, 0x67FEF95D92607890ull,
+    0x1F2B1D1F15F6DC9Cull, 0xB69E38A8965C6B65ull, 0xAA9119FF184CCCF4ull,
+    0xF43C732873F24C13ull, 0xFB4A3D794A9A80D2ull, 0x3550C2321FD6109Cull,
+    0x371F77E76BB8417Eull, 0x6BFA9AAE5EC05779ull, 0xCD04F3FF001A4778ull,
+    0xE3273522064480CAull, 0x9F91508BFFCFC14Aull, 0x049A7F41061A9E60ull,
+    0xFCB6BE43A9F2FE9Bull, 0x08DE8A1C7797DA9Bull, 0x8F9887E6078735A1ull,
+    0xB5B4071DBFC73A66ull, 0x230E343DFBA08D33ull, 0x43ED7F5A0FAE657Dull,
+    0x3A88A0FBBCB05C63ull, 0x21874B8B4D2DBC4Full, 0x1BDEA12E35F6A8C9ull,
+    0x53C065C6C8E63528ull, 0xE34A1D250E7A8D6Bull, 0xD6B04D3B7651DD7Eull,
+    0x5E90277E7CB39E2Dull, 0x2C046F22062DC67Dull, 0xB10BB459132D0A26ull,
+    0x3FA9DDFB67E2F199ull, 0x0E09B88E1914F7AFull, 0x10E8B35AF3EEAB37ull,
+    0x9EEDECA8E272B933ull, 0xD4C718BC4AE8AE5Full, 0x81536D601170FC20ull,
+    0x91B534F885818A06ull, 0xEC8177F83F900978ull, 0x190E714FADA5156Eull,
+    0xB592BF39B0364963ull, 0x89C350C893AE7DC1ull, 0xAC042E70F8B383F2ull,
+    0xB49B52E587A1EE60ull, 0xFB152FE3FF26DA89ull, 0x3E666E6F69AE2C15ull,
+    0x3B544EBE544C19F9ull, 0xE805A1E290CF2456ull, 0x24B33C9D7ED25117ull,
+    0xE74733427B72F0C1ull, 0x0A804D18B7097475ull, 0x57E3306D881EDB4Full,
+    0x4AE7D6A36EB5DBCBull, 0x2D8D5432157064C8ull, 0xD1E649DE1E7F268Bull,
+    0x8A328A1CEDFE552Cull, 0x07A3AEC79624C7DAull, 0x84547DDC3E203C94ull,
+    0x990A98FD5071D263ull, 0x1A4FF12616EEFC89ull, 0xF6F7FD1431714200ull,
+    0x30C05B1BA332F41Cull, 0x8D2636B81555A786ull, 0x46C9FEB55D120902ull,
+    0xCCEC0A73B49C9921ull, 0x4E9D2827355FC492ull, 0x19EBB029435DCB0Full,
+    0x4659D2B743848A2Cull, 0x963EF2C96B33BE31ull, 0x74F85198B05A2E7Dull,
+    0x5A0F544DD2B1FB18ull, 0x03727073C2E134B1ull, 0xC7F6AA2DE59AEA61ull,
+    0x352787BAA0D7C22Full, 0x9853EAB63B5E0B35ull, 0xABBDCDD7ED5C0860ull,
+    0xCF05DAF5AC8D77B0ull, 0x49CAD48CEBF4A71Eull, 0x7A4C10EC2158C4A6ull,
+    0xD9E92AA246BF719Eull, 0x13AE978D09FE5557ull, 0x730499AF921549FFull,
+    0x4E4B705B92903BA4ull, 0xFF577222C14F0A3Aull, 0x55B6344CF97AAFAEull,
+    0xB862225B055B6960ull, 0xCAC09AFBDDD2CDB4ull, 0xDAF8E9829FE96B5Full,
+    0xB5FDFC5D3132C498ull, 0x310CB380DB6F7503ull, 0xE87FBB46217A360Eull,
+    0x2102AE466EBB1148ull, 0xF8549E1A3AA5E00Dull, 0x07A69AFDCC42261Aull,
+    0xC4C118BFE78FEAAEull, 0xF9F4892ED96BD438ull, 0x1AF3DBE25D8F45DAull,
+    0xF5B4B0B0D2DEEEB4ull, 0x962ACEEFA82E1C84ull, 0x046E3ECAAF453CE9ull,
+    0xF05D129681949A4Cull, 0x964781CE734B3C84ull, 0x9C2ED44081CE5FBDull,
+    0x522E23F3925E319Eull, 0x177E00F9FC32F791ull, 0x2BC60A63A6F3B3F2ull,
+    0x222BBFAE61725606ull, 0x486289DDCC3D6780ull, 0x7DC7785B8EFDFC80ull,
+    0x8AF38731C02BA980ull, 0x1FAB64EA29A2DDF7ull, 0xE4D9429322CD065Aull,
+    0x9DA058C67844F20Cull, 0x24C0E332B70019B0ull, 0x233003B5A6CFE6ADull,
+    0xD586BD01C5C217F6ull, 0x5E5637885F29BC2Bull, 0x7EBA726D8C94094Bull,
+    0x0A56A5F0BFE39272ull, 0xD79476A84EE20D06ull, 0x9E4C1269BAA4BF37ull,
+    0x17EFEE45B0DEE640ull, 0x1D95B0A5FCF90BC6ull, 0x93CBE0B699C2585Dull,
+    0x65FA4F227A2B6D79ull, 0xD5F9E858292504D5ull, 0xC2B5A03F71471A6Full,
+    0x59300222B4561E00ull, 0xCE2F8642CA0712DCull, 0x7CA9723FBB2E8988ull,
+    0x2785338347F2BA08ull, 0xC61BB3A141E50E8Cull, 0x150F361DAB9DEC26ull,
+    0x9F6A419D382595F4ull, 0x64A53DC924FE7AC9ull, 0x142DE49FFF7A7C3Dull,
+    0x0C335248857FA9E7ull, 0x0A9C32D5EAE45305ull, 0xE6C42178C4BBB92Eull,
+    0x71F1CE2490D20B07ull, 0xF1BCC3D275AFE51Aull, 0xE728E8C83C334074ull,
+    0x96FBF83A12884624ull, 0x81A1549FD6573DA5ull, 0x5FA7867CAF35E149ull,
+    0x56986E2EF3ED091Bull, 0x917F1DD5F8886C61ull, 0xD20D8C88C8FFE65Full,
+    0x31D71DCE64B2C310ull, 0xF165B587DF898190ull, 0xA57E6339DD2CF3A0ull,
+    0x1EF6E6DBB1961EC9ull, 0x70CC73D90BC26E24ull, 0xE21A6B35DF0C3AD7ull,
+    0x003A93D8B2806962ull, 0x1C99DED33CB890A1ull, 0xCF3145DE0ADD4289ull,
+    0xD0E4427A5514FB72ull, 0x77C621CC9FB3A483ull, 0x67A34DAC4356550Bull,
+    0xF8D626AAAF278509ull,
+};
+
+// The Polyglot key of the position as seen from white
+[[nodiscard]] static u64 polyglot_key(const Position *const pos) {
+  u64 key = 0;
+  for (i32 c = 0; c < 2; c++) {
+    // Polyglot interleaves black and white, black first
+    const i32 white = c ^ pos->flipped ^ 1;
+    for (i32 p = Pawn; p <= King; p++) {
+      u64 copy = pos->colour[c] & pos->pieces[p];
+      while (copy) {
+        const i32 sq = lsb(copy) ^ 56 * pos->flipped;
+        key ^= polyglot_randoms[64 * (2 * (p - 1) + white) + sq];
+        copy &= copy - 1;
       }
     }
+  }
+  for (i32 i = 0; i < 4; i++) {
+    if (pos->castling[i ^ 2 * pos->flipped]) {
+      key ^= polyglot_randoms[768 + i];
+    }
+  }
+  // En passant only counts when a pawn can actually capture
+  if ((sw(pos->ep) | se(pos->ep)) & pos->colour[0] & pos->pieces[Pawn]) {
+    key ^= polyglot_randoms[772 + lsb(pos->ep) % 8];
+  }
+  if (!pos->flipped) {
+    key ^= polyglot_randoms[780];
+  }
+  return key;
+}
 
-    if (stack[ply].moves[move_index].takes_piece == None) {
-      quiets_evaluated++;
+static void close_book() {
+  if (book) {
+    munmap((void *)book, book_length * sizeof(BookEntry));
+    book = NULL;
+    book_length = 0;
+  }
+}
+
+static void open_book(const char *const path) {
+  close_book();
+  const int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) || st.st_size < (off_t)sizeof(BookEntry)) {
+    printf("info string Book %s unavailable\n", path);
+    if (fd >= 0) {
+      close(fd);
     }
+    return;
+  }
+  void *const map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("info string Book %s unavailable\n", path);
+    return;
+  }
+  book = map;
+  book_length = st.st_size / sizeof(BookEntry);
+  book_seed = get_time();
+}
 
-    // LATE MOVE PRUNING
-    if (!in_check && alpha == beta - 1 &&
-        quiets_evaluated > 1 + depth * depth) {
-      break;
+// Picks a book move for the position, either the one with the highest weight
+// or at random in proportion to the weights
+[[nodiscard]] static bool probe_book(const Position *const pos,
+                                     Move *const move) {
+  if (!book) {
+    return false;
+  }
+  const u64 key = polyglot_key(pos);
+
+  // First entry with the key
+  size_t low = 0;
+  size_t high = book_length;
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (__builtin_bswap64(book[mid].key) < key) {
+      low = mid + 1;
+    } else {
+      high = mid;
     }
   }
 
-  // MATE / STALEMATE DETECTION
-  if (best_score == -inf) {
-    return (ply - mate) * in_check;
+  u32 total = 0;
+  size_t end = low;
+  for (; end < book_length && __builtin_bswap64(book[end].key) == key; end++) {
+    total += __builtin_bswap16(book[end].weight);
+  }
+  if (low == end) {
+    return false;
   }
 
-  *tt_entry = (TTEntry){.partial_hash = tt_hash_partial,
-                        .move = stack[ply].best_move,
-                        .score = best_score,
-                        .depth = depth,
-                        .flag = tt_flag};
+  size_t chosen = low;
+  if (book_best_move) {
+    for (size_t i = low + 1; i < end; i++) {
+      if (__builtin_bswap16(book[i].weight) >
+          __builtin_bswap16(book[chosen].weight)) {
+        chosen = i;
+      }
+    }
+  } else if (total) {
+    book_seed = book_seed * 6364136223846793005ull + 1442695040888963407ull;
+    u32 pick = (book_seed >> 32) % total;
+    while (pick >= __builtin_bswap16(book[chosen].weight)) {
+      pick -= __builtin_bswap16(book[chosen].weight);
+      chosen++;
+    }
+  }
 
-  return best_score;
-}
+  // Castling is stored as the king taking its own rook
+  const u16 book_move = __builtin_bswap16(book[chosen].move);
+  const i32 from = book_move >> 6 & 63;
+  i32 to = book_move & 63;
+  if ((from == 4 || from == 60) && (to % 8 == 0 || to % 8 == 7) &&
+      1ull << (from ^ 56 * pos->flipped) & pos->colour[0] &
+          pos->pieces[King]) {
+    to = to % 8 ? from + 2 : from - 2;
+  }
+  char name[8] = {'a' + from % 8, '1' + from / 8, 'a' + to % 8,
+                  '1' + to / 8,   " nbrq"[book_move >> 12 & 7]};
+  name[4] = name[4] == ' ' ? 0 : name[4];
 
-static void iteratively_deepen(
-#ifdef FULL
-    i32 maxdepth, u64 *nodes,
-#endif
-    Position *const restrict pos, SearchStack *restrict stack,
-    const i32 pos_history_count) {
-  start_time = get_time();
-  __builtin_memset(move_history, 0, sizeof(move_history));
-#ifdef FULL
-  for (i32 depth = 1; depth < maxdepth; depth++) {
-#else
-  for (i32 depth = 1; depth < max_ply; depth++) {
-#endif
-    i32 score = search(pos, 0, depth, -inf, inf,
-#ifdef FULL
-                       nodes,
+  Move moves[max_moves];
+  const i32 num_moves = movegen_legal(pos, moves);
+  for (i32 i = 0; i < num_moves; i++) {
+    char move_name[8];
+    move_str(move_name, &moves[i], pos->flipped);
+    if (!strcmp(move_name, name)) {
+      *move = moves[i];
+      return true;
+    }
+  }
+  return false;
+}
 #endif
-                       stack, pos_history_count, false);
-    size_t elapsed = get_time() - start_time;
 
 #ifdef FULL
-    printf("info depth %i score cp %i time %i nodes %i", depth, score, elapsed,
-           *nodes);
-    if (elapsed > 0) {
-      const u64 nps = *nodes * 1000 / elapsed;
-      printf(" nps %i", nps);
+enum { position_cache_moves = 1024 };
+
+// The last position command and where it led, so that the usual resend with
+// one or two more moves only plays those
+typedef struct [[nodiscard]] {
+  char base[128]; // "startpos" or the FEN, empty when nothing is cached
+  char moves[position_cache_moves][8];
+  i32 num_moves;
+  Position pos;
+  i32 pos_history_count;
+  u64 history[1024];
+} PositionCache;
+
+static PositionCache position_cache;
+
+// Reads a move by its squares rather than generating moves to compare it with.
+// Castling is the king moving two squares, en passant takes nothing.
+[[nodiscard]] static bool decode_move(const Position *const pos,
+                                      const char *const name,
+                                      Move *const move) {
+  if (name[0] < 'a' || name[0] > 'h' || name[1] < '1' || name[1] > '8' ||
+      name[2] < 'a' || name[2] > 'h' || name[3] < '1' || name[3] > '8') {
+    return false;
+  }
+  const i32 from = (name[0] - 'a' + (name[1] - '1') * 8) ^ 56 * pos->flipped;
+  const i32 to = (name[2] - 'a' + (name[3] - '1') * 8) ^ 56 * pos->flipped;
+  if (!(pos->colour[0] >> from & 1) || pos->colour[0] >> to & 1) {
+    return false;
+  }
+  *move = (Move){
+      .from = from, .to = to, .promo = None, .takes_piece = piece_on(pos, to)};
+  for (i32 p = Knight; p <= Queen; p++) {
+    if (name[4] == "\0\0nbrq"[p]) {
+      move->promo = p;
     }
+  }
+  return true;
+}
 
-    putl(" pv ");
-    char move_name[8];
-    move_str(move_name, &stack[0].best_move, pos->flipped);
-    putl(move_name);
-    putl("\n");
-#endif
+// Plays a move given by name, if it is legal, as the move list of a position
+// command is not to be trusted
+static bool play_position_move(Position *const pos,
+                               i32 *const pos_history_count,
+                               const char *const name) {
+  Move move;
+  if (!decode_move(pos, name, &move) || !is_pseudo_legal(pos, &move)) {
+    return false;
+  }
+  const MoveMasks masks = get_masks(pos);
+  if (!is_legal(pos, &masks, &move)) {
+    return false;
+  }
+  key_history[(*pos_history_count)++] = pos->key;
+  play_move(pos, &move);
+  if (!pos->halfmove) {
+    *pos_history_count = 0;
+  }
+  return true;
+}
 
-    if (elapsed > max_time / 16) {
-      break;
-    }
+// Sets up the base position with the first num_moves cached moves played,
+// from the cache itself when that is all of them
+static void restore_position(Position *const pos, i32 *const pos_history_count,
+                             const char *const base, const i32 num_moves) {
+  if (!strcmp(base, position_cache.base) &&
+      num_moves == position_cache.num_moves) {
+    *pos = position_cache.pos;
+    *pos_history_count = position_cache.pos_history_count;
+    __builtin_memcpy(key_history, position_cache.history,
+                     sizeof(u64) * *pos_history_count);
+    return;
   }
-  char move_name[8];
-  move_str(move_name, &stack[0].best_move, pos->flipped);
-  putl("bestmove ");
-  putl(move_name);
-  putl("\n");
+  set_fen(pos, strcmp(base, "startpos")
+                   ? base
+                   : "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq -");
+  *pos_history_count = 0;
+  for (i32 i = 0; i < num_moves; i++) {
+    play_position_move(pos, pos_history_count, position_cache.moves[i]);
+  }
+  __builtin_memcpy(position_cache.base, base, sizeof position_cache.base);
+  position_cache.num_moves = num_moves;
 }
 
-static void display_pos(Position *const pos) {
-  Position npos = *pos;
-  if (npos.flipped) {
-    flip_pos(&npos);
+// Reads the rest of a position command, playing only the moves beyond those
+// it shares with the last one. Returns the number of history positions.
+[[nodiscard]] static i32 read_position(Position *const pos, char *line,
+                                       bool line_continue) {
+  char base[128] = "startpos";
+  if (line_continue) {
+    line_continue = getl(line);
   }
-  for (i32 rank = 7; rank >= 0; rank--) {
-    for (i32 file = 0; file < 8; file++) {
-      i32 sq = rank * 8 + file;
-      u64 bb = 1ULL << sq;
-      i32 piece = piece_on(&npos, sq);
-      if (bb & npos.colour[0]) {
-        if (piece == Pawn) {
-          putl("P");
-        } else if (piece == Knight) {
-          putl("N");
-        } else if (piece == Bishop) {
-          putl("B");
-        } else if (piece == Rook) {
-          putl("R");
-        } else if (piece == Queen) {
-          putl("Q");
-        } else if (piece == King) {
-          putl("K");
-        }
-      } else if (bb & npos.colour[1]) {
-        if (piece == Pawn) {
-          putl("p");
-        } else if (piece == Knight) {
-          putl("n");
-        } else if (piece == Bishop) {
-          putl("b");
-        } else if (piece == Rook) {
-          putl("r");
-        } else if (piece == Queen) {
-          putl("q");
-        } else if (piece == King) {
-          putl("k");
-        }
-      } else {
-        putl(".");
+  if (!strcmp(line, "fen")) {
+    // Gather the FEN fields up to "moves" back into one string
+    i32 length = 0;
+    while (line_continue) {
+      line_continue = getl(line);
+      const i32 word_length = strlen(line);
+      if (!strcmp(line, "moves") ||
+          length + word_length + 1 >= (i32)sizeof base) {
+        break;
       }
+      __builtin_memcpy(base + length, line, word_length);
+      length += word_length;
+      base[length++] = ' ';
     }
-    putl("\n");
-  }
-  putl("\nTurn: ");
-  putl(pos->flipped ? "Black" : "White");
-  putl("\nEval: ");
-  i32 score = eval(pos);
-  if (pos->flipped) {
-    score = -score;
+    base[length] = 0;
   }
-  printf("%i\n", score);
-}
 
-#ifdef FULL
-static void bench() {
-  Position pos;
+  const bool same_base = !strcmp(base, position_cache.base);
   i32 pos_history_count = 0;
-#ifdef LOWSTACK
-  SearchStack *stack = malloc(sizeof(SearchStack) * 1024);
-#else
-  SearchStack stack[1024];
-#endif
+  i32 matched = 0;
+  bool restored = false;
+  while (line_continue) {
+    line_continue = getl(line);
+    if (!strcmp(line, "moves")) {
+      continue;
+    }
+    if (!restored) {
+      if (same_base && matched < position_cache.num_moves &&
+          !strcmp(line, position_cache.moves[matched])) {
+        matched++;
+        continue;
+      }
+      restore_position(pos, &pos_history_count, base, matched);
+      restored = true;
+    }
+    // Illegal moves are skipped, and left out of the cache
+    if (!play_position_move(pos, &pos_history_count, line)) {
+      continue;
+    }
+    if (position_cache.num_moves < position_cache_moves &&
+        strlen(line) < (i32)sizeof position_cache.moves[0]) {
+      __builtin_memcpy(position_cache.moves[position_cache.num_moves++], line,
+                       strlen(line) + 1);
+    } else {
+      position_cache.base[0] = 0;
+    }
+  }
+  if (!restored) {
+    restore_position(pos, &pos_history_count, base, matched);
+  }
 
-  pos = (Position){.ep = 0,
-                   .colour = {0xFFFFull, 0xFFFF000000000000ull},
-                   .pieces = {0, 0xFF00000000FF00ull, 0x4200000000000042ull,
-                              0x2400000000000024ull, 0x8100000000000081ull,
-                              0x800000000000008ull, 0x1000000000000010ull},
-                   .castling = {true, true, true, true}};
-  max_time = 99999999999;
-  u64 nodes = 0;
-  const u64 start = get_time();
-  iteratively_deepen(18, &nodes, &pos, stack, pos_history_count);
-  const u64 end = get_time();
-  const i32 elapsed = end - start;
-  const u64 nps = elapsed ? 1000 * nodes / elapsed : 0;
-  printf("%i nodes %i nps\n", nodes, nps);
+  position_cache.pos = *pos;
+  position_cache.pos_history_count = pos_history_count;
+  __builtin_memcpy(position_cache.history, key_history,
+                   sizeof(u64) * pos_history_count);
+  return pos_history_count;
 }
 #endif
 
@@ -1224,6 +6263,8 @@ static void run() {
                               0x2400000000000024ull, 0x8100000000000081ull,
                               0x800000000000008ull, 0x1000000000000010ull},
                    .castling = {true, true, true, true}};
+  pos.key = get_key(&pos);
+  set_psq(&pos);
   pos_history_count = 0;
 #endif
 
@@ -1235,36 +6276,207 @@ static void run() {
 
   // UCI loop
   while (true) {
+#ifdef FULL
+    bool line_continue = getl(line);
+#else
     getl(line);
+#endif
+#ifdef HOSTED
+    // Only stop, ponderhit and isready are handled while a search is running
+    if (!strcmp(line, "stop") || line[0] == 'q') {
+      stop = true;
+      // Helpers may still be writing to the table, which can be a file
+      if (line[0] == 'q') {
+        wait_for_search();
+      }
+    } else if (!strcmp(line, "ponderhit")) {
+      start_time = get_time();
+      pondering = false;
+      continue;
+    } else if (line[0] != 'i') {
+      wait_for_search();
+    }
+#endif
 #ifdef FULL
     u64 nodes = 0;
     if (!strcmp(line, "uci")) {
       putl("id name 4k.c\n");
       putl("id author Gediminas Masaitis\n");
       putl("\n");
+#ifdef HOSTED
+      printf("option name Hash type spin default %i min 1 max %i\n",
+             default_hash, max_hash);
+      printf("option name Threads type spin default 1 min 1 max %i\n",
+             max_threads);
+      putl("option name Ponder type check default false\n");
+      putl("option name OwnBook type check default false\n");
+      putl("option name BookFile type string default <empty>\n");
+      putl("option name BookBestMove type check default false\n");
+      putl("option name SyzygyPath type string default <empty>\n");
+      putl("option name EvalFile type string default <empty>\n");
+      putl("option name HashFile type string default <empty>\n");
+#else
       putl("option name Hash type spin default 1 min 1 max 1\n");
       putl("option name Threads type spin default 1 min 1 max 1\n");
+#endif
+      putl("option name UseNNUE type check default false\n");
       putl("uciok\n");
+    } else if (!strcmp(line, "setoption")) {
+      char name[64];
+      getl(line);
+      if (getl(name) && getl(line)) {
+        // The value runs to the end of the line, as paths may hold spaces
+        char *value = line;
+        while (getl(value)) {
+          value += strlen(value);
+          *value++ = ' ';
+        }
+      }
+#ifdef HOSTED
+      if (!strcmp(name, "Threads")) {
+        num_threads = atoi(line);
+        num_threads = num_threads < 1             ? 1
+                      : num_threads > max_threads ? max_threads
+                                                  : num_threads;
+      } else if (!strcmp(name, "Hash")) {
+        const u32 megabytes = atoi(line);
+        resize_tt(megabytes < 1          ? 1
+                  : megabytes > max_hash ? max_hash
+                                         : megabytes);
+      } else if (!strcmp(name, "OwnBook")) {
+        own_book = !strcmp(line, "true");
+      } else if (!strcmp(name, "BookFile")) {
+        if (strcmp(line, "<empty>")) {
+          open_book(line);
+        } else {
+          close_book();
+        }
+      } else if (!strcmp(name, "BookBestMove")) {
+        book_best_move = !strcmp(line, "true");
+      } else if (!strcmp(name, "SyzygyPath")) {
+        if (strcmp(line, "<empty>")) {
+          tb_init(line);
+        } else {
+          tb_free();
+        }
+      } else if (!strcmp(name, "EvalFile")) {
+        load_eval_file(line);
+      } else if (!strcmp(name, "HashFile")) {
+        const size_t megabytes = tt_size >> 20;
+        tt_file[0] = 0;
+        if (strcmp(line, "<empty>") && strlen(line) < sizeof tt_file) {
+          __builtin_memcpy(tt_file, line, strlen(line) + 1);
+        }
+        resize_tt(megabytes ? megabytes : 1);
+      }
+#endif
+      if (!strcmp(name, "UseNNUE")) {
+        nnue_option = !strcmp(line, "true");
+        use_nnue = nnue_option && nnue_loaded;
+        if (nnue_option && !nnue_loaded) {
+          putl("info string No network loaded, using the classical eval\n");
+        }
+      }
     } else if (!strcmp(line, "ucinewgame")) {
-      __builtin_memset(tt, 0, tt_length * sizeof(TTEntry));
+#ifdef HOSTED
+      // A table kept in a file is meant to outlive games
+      if (!tt_file[0]) {
+        clear_tt();
+      }
+#else
+      clear_tt();
+#endif
     } else if (!strcmp(line, "bench")) {
-      bench();
+      i32 depth = bench_depth;
+      i32 output = Output_Plain;
+      while (line_continue) {
+        line_continue = getl(line);
+        if (!strcmp(line, "json")) {
+          output = Output_Json;
+        } else if (!strcmp(line, "csv")) {
+          output = Output_Csv;
+        } else {
+          depth = atoi(line);
+        }
+      }
+#ifdef HOSTED
+      detach_tt_file();
+#endif
+      bench(depth, output);
+#ifdef HOSTED
+      attach_tt_file();
+#endif
+#ifdef STATS
+    } else if (!strcmp(line, "stats")) {
+      print_stats(last_stats, "total");
+#endif
+    } else if (!strcmp(line, "hashbench")) {
+      hash_bench(&pos);
+#if defined(__x86_64__) || defined(_M_X64)
+    } else if (!strcmp(line, "microbench")) {
+      microbench();
+#endif
+#ifdef HOSTED
+    } else if (!strcmp(line, "smpbench")) {
+      detach_tt_file();
+      smp_bench(num_threads);
+      attach_tt_file();
+    } else if (!strcmp(line, "warmbench")) {
+      i32 depth = bench_depth;
+      if (line_continue) {
+        line_continue = getl(line);
+        depth = atoi(line);
+      }
+      detach_tt_file();
+      warm_bench(depth);
+      attach_tt_file();
+    } else if (!strcmp(line, "savehash") || !strcmp(line, "loadhash")) {
+      // The path is read apart, as line is matched against commands below
+      char path[4096] = "";
+      if (line_continue) {
+        line_continue = getl(path);
+      }
+      if (line[0] == 's') {
+        save_tt(path);
+      } else {
+        load_tt(path);
+      }
+    } else if (!strcmp(line, "tbprobe")) {
+      // WDL and DTZ for the side to move, as tbverify.py checks them
+      i32 state = Tb_Fail;
+      i32 wdl = 0;
+      i32 dtz = 0;
+      if (tb_probeable(&pos)) {
+        wdl = tb_probe_wdl(&pos, &state);
+      }
+      if (state != Tb_Fail) {
+        dtz = tb_probe_dtz(&pos, &state);
+      }
+      if (state == Tb_Fail) {
+        printf("info string No tablebase for this position\n");
+      } else {
+        printf("info string wdl %i dtz %i\n", wdl, dtz);
+      }
+      fflush(stdout);
+#endif
     } else if (!strcmp(line, "gi")) {
-      max_time = 99999999999;
+      limits = no_limits;
+#ifdef HOSTED
+      stop = false;
+#endif
       iteratively_deepen(max_ply, &nodes, &pos, stack, pos_history_count);
     } else if (!strcmp(line, "d")) {
       display_pos(&pos);
     } else if (!strcmp(line, "perft")) {
-      char depth_str[4];
+      char depth_str[8];
       getl(depth_str);
-      const i32 depth = atoi(depth_str);
-      const u64 start = get_time();
-      nodes = perft(&pos, depth);
-      const u64 end = get_time();
-      const u64 elapsed = end - start;
-      const u64 nps = elapsed ? 1000 * nodes / elapsed : 0;
-      printf("info depth %i nodes %i time %i nps %i \n", depth, nodes, elapsed,
-             nps);
+      const bool divide = !strcmp(depth_str, "divide");
+      if (divide) {
+        getl(depth_str);
+      }
+      perft_command(&pos, atoi(depth_str), divide);
+    } else if (!strcmp(line, "perftsuite")) {
+      perft_suite();
     }
 #endif
     if (line[0] == 'q') {
@@ -1272,6 +6484,9 @@ static void run() {
     } else if (line[0] == 'i') {
       putl("readyok\n");
     } else if (line[0] == 'p') {
+#ifdef FULL
+      pos_history_count = read_position(&pos, line, line_continue);
+#else
       pos = (Position){.ep = 0,
                        .colour = {0xFFFFull, 0xFFFF000000000000ull},
                        .pieces = {0, 0xFF00000000FF00ull, 0x4200000000000042ull,
@@ -1301,24 +6516,82 @@ static void run() {
           break;
         }
       }
+#endif
     } else if (line[0] == 'g') {
 #ifdef FULL
-      while (true) {
-        getl(line);
-        if (!pos.flipped && !strcmp(line, "wtime")) {
-          getl(line);
-          max_time = atoi(line) / 2;
-          break;
-        } else if (pos.flipped && !strcmp(line, "btime")) {
-          getl(line);
-          max_time = atoi(line) / 2;
-          break;
-        } else if (!strcmp(line, "movetime")) {
-          max_time = 20000; // Assume Lichess bot
+      limits = no_limits;
+      i32 maxdepth = max_ply;
+      size_t time = 0;
+      size_t inc = 0;
+      i32 moves_to_go = 0;
+      bool timed = false;
+      while (line_continue) {
+        line_continue = getl(line);
+        char key[16];
+        __builtin_memcpy(key, line, sizeof key);
+        key[sizeof key - 1] = 0;
+        if (!strcmp(key, "infinite")) {
+#ifdef HOSTED
+          infinite = true;
+#endif
+          continue;
+        }
+        if (!strcmp(key, "ponder")) {
+#ifdef HOSTED
+          pondering = true;
+#endif
+          continue;
+        }
+        if (!line_continue) {
           break;
         }
+        line_continue = getl(line);
+        const u64 value = strtoull(line, NULL, 10);
+        if (!strcmp(key, pos.flipped ? "btime" : "wtime")) {
+          time = value;
+          timed = true;
+        } else if (!strcmp(key, pos.flipped ? "binc" : "winc")) {
+          inc = value;
+        } else if (!strcmp(key, "movestogo")) {
+          moves_to_go = value;
+        } else if (!strcmp(key, "movetime")) {
+          limits.soft = limits.hard =
+              value > move_overhead ? value - move_overhead : 1;
+        } else if (!strcmp(key, "depth")) {
+          maxdepth = value < max_ply ? value + 1 : max_ply;
+        } else if (!strcmp(key, "nodes")) {
+          limits.nodes = value;
+        } else if (!strcmp(key, "mate")) {
+          limits.mate = value;
+        }
+      }
+      if (timed) {
+        set_time_limits(time, inc, moves_to_go);
+      }
+#ifdef HOSTED
+      // Book moves are played at once unless the search has to wait, and so
+      // are tablebase moves on the clock. Other searches of a tablebase
+      // position keep to the root moves that hold its outcome.
+      const bool waits = infinite || pondering;
+      Move instant_move;
+      tb_root_key = 0;
+      bool instant = !waits && own_book && probe_book(&pos, &instant_move);
+      if (!instant && tb_probe_root(&pos, &instant_move)) {
+        instant = !waits && limits.hard != no_limits.hard;
+        tb_root_key = instant ? 0 : pos.key;
+      }
+      if (instant) {
+        char move_name[8];
+        move_str(move_name, &instant_move, pos.flipped);
+        putl("bestmove ");
+        putl(move_name);
+        putl("\n");
+      } else {
+        start_search(&pos, stack, pos_history_count, maxdepth);
       }
-      iteratively_deepen(max_ply, &nodes, &pos, stack, pos_history_count);
+#else
+      iteratively_deepen(maxdepth, &nodes, &pos, stack, pos_history_count);
+#endif
 #else
       for (i32 i = 0; i < (pos.flipped ? 4 : 2); i++) {
         getl(line);
@@ -1341,12 +6614,71 @@ __attribute__((naked)) void _start() {
 #else
 int main(int argc, char **argv) {
 #endif
+#ifdef FULL
+  init_zobrist();
+  init_psq_table();
+#endif
+#ifdef EVALFILE
+  nnue_load(nnue_embedded, nnue_embedded_end - nnue_embedded);
+#endif
+#ifdef HOSTED
+  resize_tt(default_hash);
+#endif
 #ifdef FULL
   if (argc > 1 && !strcmp(argv[1], "bench")) {
+    i32 depth = bench_depth;
+    i32 output = Output_Plain;
+    for (i32 i = 2; i < argc; i++) {
+      if (!strcmp(argv[i], "json")) {
+        output = Output_Json;
+      } else if (!strcmp(argv[i], "csv")) {
+        output = Output_Csv;
+      } else {
+        depth = atoi(argv[i]);
+      }
+    }
+    init_diag_masks();
+    bench(depth, output);
+    exit_now();
+  }
+#if defined(__x86_64__) || defined(_M_X64)
+  if (argc > 1 && !strcmp(argv[1], "microbench")) {
+    init_diag_masks();
+    microbench();
+    exit_now();
+  }
+#endif
+  if (argc > 1 && !strcmp(argv[1], "perftsuite")) {
+    init_diag_masks();
+    perft_suite();
+    exit_now();
+  }
+#ifdef HOSTED
+  if (argc > 2 && !strcmp(argv[1], "smpbench")) {
+    init_diag_masks();
+    smp_bench(atoi(argv[2]));
+    exit_now();
+  }
+  if (argc > 2 && !strcmp(argv[1], "analyze")) {
+    init_diag_masks();
+    analyze(argc, argv);
+    exit_now();
+  }
+  if (argc > 2 && !strcmp(argv[1], "datagen")) {
+    init_diag_masks();
+    datagen(argc, argv);
+    exit_now();
+  }
+  if (argc > 2 && !strcmp(argv[1], "convert")) {
+    convert(argc, argv);
+    exit_now();
+  }
+  if (argc > 2 && !strcmp(argv[1], "tune")) {
     init_diag_masks();
-    bench();
+    tune(argc, argv);
     exit_now();
   }
+#endif
 #endif
   run();
 }
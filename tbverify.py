@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+import subprocess
+import sys
+
+# Probes positions of known value through the engine's tbprobe command and
+# compares the WDL and DTZ it reports, for the side to move, with the known
+# ones. Needs the 3, 4 and 5 piece Syzygy tables of the positions below. A
+# DTZ of None is only checked for its sign.
+BINARY_NAME = "./build/4kc"
+POSITIONS = [
+    # Mate in one with Qg8
+    ("k7/8/1K6/8/8/8/8/6Q1 w - - 0 1", 2, 1),
+    # Kb8 is the only move
+    ("k7/8/1K6/8/8/8/8/6Q1 b - - 0 1", -2, None),
+    # Kxb1 leaves the bare kings
+    ("8/8/8/8/8/8/8/kR5K b - - 0 1", 0, 0),
+    # King on the sixth rank ahead of its pawn wins with either side to move
+    ("4k3/8/4K3/4P3/8/8/8/8 w - - 0 1", 2, None),
+    ("4k3/8/4K3/4P3/8/8/8/8 b - - 0 1", -2, None),
+    # The same with colours reversed
+    ("8/8/8/8/4p3/4k3/8/4K3 b - - 0 1", 2, None),
+    # Pawn on the seventh, defending king in front: stalemate or a draw
+    ("4k3/4P3/4K3/8/8/8/8/8 b - - 0 1", 0, 0),
+    ("4k3/4P3/4K3/8/8/8/8/8 w - - 0 1", 0, 0),
+    # Three queens against a bare king
+    ("7k/8/8/8/8/8/8/KQQQ4 w - - 0 1", 2, None),
+]
+
+
+def send(engine, line):
+    engine.stdin.write(line + "\n")
+    engine.stdin.flush()
+
+
+def wait_for(engine, prefix):
+    while True:
+        line = engine.stdout.readline()
+        if not line:
+            raise RuntimeError("engine exited")
+        if line.startswith(prefix):
+            return line
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(f"usage: {sys.argv[0]} syzygy_path [binary]")
+        sys.exit(2)
+    binary = sys.argv[2] if len(sys.argv) > 2 else BINARY_NAME
+    engine = subprocess.Popen([binary], stdin=subprocess.PIPE,
+                              stdout=subprocess.PIPE, text=True, bufsize=1)
+    send(engine, "uci")
+    wait_for(engine, "uciok")
+    send(engine, f"setoption name SyzygyPath value {sys.argv[1]}")
+    send(engine, "isready")
+    wait_for(engine, "readyok")
+
+    failures = 0
+    for fen, wdl, dtz in POSITIONS:
+        send(engine, f"position fen {fen}")
+        send(engine, "tbprobe")
+        words = wait_for(engine, "info string").split()
+        if "wdl" not in words:
+            print(f"{fen}: {' '.join(words[2:])}")
+            failures += 1
+            continue
+        got_wdl = int(words[words.index("wdl") + 1])
+        got_dtz = int(words[words.index("dtz") + 1])
+        dtz_ok = (got_dtz == dtz if dtz is not None
+                  else (got_dtz > 0) - (got_dtz < 0) == (wdl > 0) - (wdl < 0))
+        ok = got_wdl == wdl and dtz_ok
+        failures += not ok
+        print(f"{'ok  ' if ok else 'FAIL'} {fen}: wdl {got_wdl} dtz {got_dtz}"
+              f" (expected wdl {wdl} dtz {'any' if dtz is None else dtz})")
+
+    send(engine, "quit")
+    engine.wait()
+    print(f"{len(POSITIONS) - failures} of {len(POSITIONS)} positions match")
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == "__main__":
+    main()
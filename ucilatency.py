@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+import subprocess
+import sys
+import time
+
+# Plays a long game against itself through UCI and measures the round trip of
+# every "position startpos moves ..." line (answered by isready) and of a
+# shallow search, which together are what the engine's I/O costs a GUI.
+BINARY_NAME = "./build/4kc"
+PLIES = 200
+GO_COMMAND = "go depth 1"
+
+
+def send(engine, line):
+    engine.stdin.write(line + "\n")
+    engine.stdin.flush()
+
+
+def wait_for(engine, prefix):
+    while True:
+        line = engine.stdout.readline()
+        if not line:
+            raise RuntimeError("engine exited")
+        if line.startswith(prefix):
+            return line
+
+
+def summary(name, times):
+    times = sorted(times)
+    mean = sum(times) / len(times)
+    print(f"{name}: mean {mean * 1e6:.0f} us, median "
+          f"{times[len(times) // 2] * 1e6:.0f} us, max {times[-1] * 1e6:.0f} us")
+
+
+def main():
+    binary = sys.argv[1] if len(sys.argv) > 1 else BINARY_NAME
+    plies = int(sys.argv[2]) if len(sys.argv) > 2 else PLIES
+    engine = subprocess.Popen([binary], stdin=subprocess.PIPE,
+                              stdout=subprocess.PIPE, text=True, bufsize=1)
+    send(engine, "uci")
+    wait_for(engine, "uciok")
+
+    moves = []
+    position_times = []
+    go_times = []
+    for _ in range(plies):
+        position = "position startpos"
+        if moves:
+            position += " moves " + " ".join(moves)
+
+        start = time.perf_counter()
+        send(engine, position)
+        send(engine, "isready")
+        wait_for(engine, "readyok")
+        position_times.append(time.perf_counter() - start)
+
+        start = time.perf_counter()
+        send(engine, GO_COMMAND)
+        best = wait_for(engine, "bestmove").split()
+        go_times.append(time.perf_counter() - start)
+
+        if len(best) < 2 or best[1] in ("0000", "(none)"):
+            break
+        moves.append(best[1])
+
+    send(engine, "quit")
+    engine.wait()
+    print(f"{len(position_times)} plies")
+    summary("position + isready", position_times)
+    summary(GO_COMMAND, go_times)
+
+
+if __name__ == "__main__":
+    main()